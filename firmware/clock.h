@@ -5,18 +5,25 @@
  * Description....: Provides functions for timing/waiting
  * Licence........: GNU GPL v2 (see Readme.txt)
  * Creation Date..: 2005-02-23
- * Last change....: 2006-11-16
+ * Last change....: 2026-10-16
  */
 
 #ifndef __clock_h_included__
 #define	__clock_h_included__
 
+/* 12, 16 or 20 MHz, see F_CPU in Makefile */
+#ifndef F_CPU
 #define F_CPU           12000000L   /* 12MHz */
+#endif
 #define TIMERVALUE      TCNT0
-#define CLOCK_T_320us	60
+#define CLOCK_T_320us	(F_CPU / 64 / 3125)	/* 60 at 12MHz */
+
+/* timer 0 overflows per second */
+#define CLOCK_OVF_PER_SEC	(F_CPU / 64 / 256)
 
 #ifdef __AVR_ATmega8__
 #define TCCR0B  TCCR0
+#define TIFR0   TIFR
 #endif
 
 /* set prescaler to 64 */
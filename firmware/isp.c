@@ -10,16 +10,115 @@
  */
 
 #include <avr/io.h>
+#include <avr/pgmspace.h>
 #include "isp.h"
 #include "clock.h"
 #include "usbasp.h"
 
 #define spiHWdisable() SPCR = 0
 
-uchar sck_sw_delay;
+unsigned int sck_sw_delay;
 uchar sck_spcr;
 uchar sck_spsr;
 uchar isp_hiaddr;
+uchar isp_sck;
+uchar isp_retries;
+
+/* pending write, checked by ispPoll */
+#define ISP_WAIT_NONE 0
+#define ISP_WAIT_TIME 1 /* fixed delay */
+#define ISP_WAIT_POLL 2 /* read back until value changes */
+#define ISP_WAIT_RDYBSY 3 /* Poll RDY/BSY until ready */
+
+static uchar isp_wait = ISP_WAIT_NONE;
+static uchar isp_wait_ticks;
+static uint8_t isp_wait_start;
+static unsigned long isp_wait_address;
+static uchar isp_wait_value;
+
+/* write times of known devices: tWD_FLASH and tWD_EEPROM from the
+   datasheets, rounded up to 320us ticks */
+#define ISP_DEVICE_RDYBSY 0x01 /* Poll RDY/BSY ($F0) in the serial
+                                  instruction set, ATmega8/16/32 lack it */
+
+typedef struct {
+	uchar signature[2]; /* signature bytes 1 and 2, byte 0 is 0x1E */
+	uchar flash_ticks;
+	uchar eeprom_ticks;
+	uchar flags;
+} ispDevice_t;
+
+static const ispDevice_t isp_devices[] PROGMEM = {
+	{ { 0x93, 0x07 }, 15, 29, 0 }, /* ATmega8 */
+	{ { 0x94, 0x03 }, 15, 29, 0 }, /* ATmega16 */
+	{ { 0x95, 0x02 }, 15, 29, 0 }, /* ATmega32 */
+	{ { 0x95, 0x87 }, 15, 29, ISP_DEVICE_RDYBSY }, /* ATmega32U4 */
+	{ { 0x97, 0x03 }, 15, 29, ISP_DEVICE_RDYBSY }, /* ATmega1280 */
+	{ { 0x98, 0x01 }, 15, 29, ISP_DEVICE_RDYBSY }, /* ATmega2560 */
+	{ { 0x92, 0x05 }, 15, 12, ISP_DEVICE_RDYBSY }, /* ATmega48 */
+	{ { 0x92, 0x0A }, 15, 12, ISP_DEVICE_RDYBSY }, /* ATmega48P */
+	{ { 0x93, 0x0A }, 15, 12, ISP_DEVICE_RDYBSY }, /* ATmega88 */
+	{ { 0x93, 0x0F }, 15, 12, ISP_DEVICE_RDYBSY }, /* ATmega88P */
+	{ { 0x94, 0x06 }, 15, 12, ISP_DEVICE_RDYBSY }, /* ATmega168 */
+	{ { 0x94, 0x0B }, 15, 12, ISP_DEVICE_RDYBSY }, /* ATmega168P */
+	{ { 0x95, 0x14 }, 15, 12, ISP_DEVICE_RDYBSY }, /* ATmega328 */
+	{ { 0x95, 0x0F }, 15, 12, ISP_DEVICE_RDYBSY }, /* ATmega328P */
+	{ { 0x96, 0x0A }, 15, 12, ISP_DEVICE_RDYBSY }, /* ATmega644P */
+	{ { 0x97, 0x05 }, 15, 12, ISP_DEVICE_RDYBSY }, /* ATmega1284P */
+	{ { 0x90, 0x07 }, 15, 13, ISP_DEVICE_RDYBSY }, /* ATtiny13 */
+	{ { 0x91, 0x0A }, 15, 13, ISP_DEVICE_RDYBSY }, /* ATtiny2313 */
+	{ { 0x91, 0x08 }, 15, 13, ISP_DEVICE_RDYBSY }, /* ATtiny25 */
+	{ { 0x92, 0x06 }, 15, 13, ISP_DEVICE_RDYBSY }, /* ATtiny45 */
+	{ { 0x93, 0x0B }, 15, 13, ISP_DEVICE_RDYBSY }, /* ATtiny85 */
+};
+
+#define ISP_DEVICES (sizeof(isp_devices) / sizeof(isp_devices[0]))
+
+/* times for unknown devices: slowest AVR */
+#define ISP_FLASH_TICKS  15 /* 4,8 ms */
+#define ISP_EEPROM_TICKS 30 /* 9,6 ms */
+
+#ifdef ISP_WITH_GANG
+uchar isp_gang = 1;
+
+#define ispGangLow()    ISP_GANG_OUT &= ~ISP_GANG_MASK
+#define ispGangHigh()   ISP_GANG_OUT |= ISP_GANG_MASK
+
+/* drive RST of selected targets, the others stay inputs and run. RST
+   level follows ISP_RST through ispGangLow/ispGangHigh */
+static void ispGangEnable() {
+	if (!(isp_gang & 1)) {
+		ISP_DDR &= ~(1 << ISP_RST);
+	}
+	ISP_GANG_DDR = (ISP_GANG_DDR & ~ISP_GANG_MASK)
+			| ((isp_gang << ISP_GANG_SHIFT) & ISP_GANG_MASK);
+}
+#else
+#define ispGangLow()
+#define ispGangHigh()
+#define ispGangEnable()
+#endif
+
+/* hardware SCK: SPI prescaler F_CPU / (1 << n) for USBASP_ISP_SCK_1500,
+   each slower option doubles it. Above 12MHz one step more, so SCK never
+   exceeds the nominal frequency of an option */
+#if F_CPU > 12000000L
+#define ISP_SPI_DIV_1500 4	/* F_CPU/16: 1MHz at 16MHz, 1.25MHz at 20MHz */
+#else
+#define ISP_SPI_DIV_1500 3	/* F_CPU/8: 1.5MHz at 12MHz */
+#endif
+
+/* slowest option the SPI prescaler (max. F_CPU/128) can do */
+#define ISP_SCK_HW_MIN	(USBASP_ISP_SCK_1500 - 7 + ISP_SPI_DIV_1500)
+
+/* software SCK half period in timer ticks: 3 at 12MHz for 32kHz, and
+   rounded up for 93.75kHz when the SPI prescaler can't go that low */
+#define ISP_SW_DELAY_32	(F_CPU / 4000000L)
+#define ISP_SW_DELAY_93_75	((F_CPU + 11999999L) / 12000000L)
+
+static uchar isp_flash_ticks = ISP_FLASH_TICKS;
+static uchar isp_eeprom_ticks = ISP_EEPROM_TICKS;
+static uchar isp_device_flags;
 
 void spiHWenable() {
 	SPCR = sck_spcr;
@@ -27,71 +126,57 @@ void spiHWenable() {
 }
 
 void ispSetSCKOption(uchar option) {
+	uchar n;
 
-	if (option == USBASP_ISP_SCK_AUTO)
+	if ((option == USBASP_ISP_SCK_AUTO) || (option > USBASP_ISP_SCK_1500))
 		option = USBASP_ISP_SCK_375;
 
-	if (option >= USBASP_ISP_SCK_93_75) {
+	isp_sck = option;
+
+	if (option >= ISP_SCK_HW_MIN) {
 		ispTransmit = ispTransmit_hw;
-		sck_spsr = 0;
 		sck_sw_delay = 1;	/* force RST#/SCK pulse for 320us */
 
-		switch (option) {
-
-		case USBASP_ISP_SCK_1500:
-			/* enable SPI, master, 1.5MHz, XTAL/8 */
-			sck_spcr = (1 << SPE) | (1 << MSTR) | (1 << SPR0);
-			sck_spsr = (1 << SPI2X);
-		case USBASP_ISP_SCK_750:
-			/* enable SPI, master, 750kHz, XTAL/16 */
-			sck_spcr = (1 << SPE) | (1 << MSTR) | (1 << SPR0);
-			break;
-		case USBASP_ISP_SCK_375:
-		default:
-			/* enable SPI, master, 375kHz, XTAL/32 (default) */
-			sck_spcr = (1 << SPE) | (1 << MSTR) | (1 << SPR1);
-			sck_spsr = (1 << SPI2X);
-			break;
-		case USBASP_ISP_SCK_187_5:
-			/* enable SPI, master, 187.5kHz XTAL/64 */
-			sck_spcr = (1 << SPE) | (1 << MSTR) | (1 << SPR1);
-			break;
-		case USBASP_ISP_SCK_93_75:
-			/* enable SPI, master, 93.75kHz XTAL/128 */
-			sck_spcr = (1 << SPE) | (1 << MSTR) | (1 << SPR1) | (1 << SPR0);
-			break;
-		}
+		/* enable SPI, master, prescaler F_CPU / (1 << n), n = 1..7 */
+		n = ISP_SPI_DIV_1500 + USBASP_ISP_SCK_1500 - option;
+		sck_spcr = (1 << SPE) | (1 << MSTR) | (((n - 1) >> 1) << SPR0);
+		sck_spsr = ((n & 1) && (n != 7)) ? (1 << SPI2X) : 0;
 
 	} else {
+		/* software SCK keeps its nominal frequency at any F_CPU, at most */
 		ispTransmit = ispTransmit_sw;
 		switch (option) {
 
+		case USBASP_ISP_SCK_93_75:
+			sck_sw_delay = ISP_SW_DELAY_93_75;
+
+			break;
 		case USBASP_ISP_SCK_32:
-			sck_sw_delay = 3;
+			sck_sw_delay = ISP_SW_DELAY_32;
 
 			break;
 		case USBASP_ISP_SCK_16:
-			sck_sw_delay = 6;
+			sck_sw_delay = ISP_SW_DELAY_32 << 1;
 
 			break;
 		case USBASP_ISP_SCK_8:
-			sck_sw_delay = 12;
+			sck_sw_delay = ISP_SW_DELAY_32 << 2;
 
 			break;
 		case USBASP_ISP_SCK_4:
-			sck_sw_delay = 24;
+			sck_sw_delay = ISP_SW_DELAY_32 << 3;
 
 			break;
 		case USBASP_ISP_SCK_2:
-			sck_sw_delay = 48;
+			sck_sw_delay = ISP_SW_DELAY_32 << 4;
 
 			break;
 		case USBASP_ISP_SCK_1:
-			sck_sw_delay = 96;
+			sck_sw_delay = ISP_SW_DELAY_32 << 5;
 
 			break;
 		case USBASP_ISP_SCK_0_5:
-			sck_sw_delay = 192;
+			sck_sw_delay = ISP_SW_DELAY_32 << 6;
 
 			break;
 		}
@@ -101,7 +186,16 @@ void ispSetSCKOption(uchar option) {
 void ispDelay() {
 
 	uint8_t starttime = TIMERVALUE;
-	while ((uint8_t) (TIMERVALUE - starttime) < sck_sw_delay) {
+	unsigned int delay = sck_sw_delay;
+
+	/* timer is 8 bit, wait longer delays in steps of 128 ticks */
+	while (delay > 128) {
+		while ((uint8_t) (TIMERVALUE - starttime) < 128) {
+		}
+		starttime += 128;
+		delay -= 128;
+	}
+	while ((uint8_t) (TIMERVALUE - starttime) < delay) {
 	}
 }
 
@@ -110,16 +204,20 @@ void ispConnect() {
 	/* all ISP pins are inputs before */
 	/* now set output pins */
 	ISP_DDR |= (1 << ISP_RST) | (1 << ISP_SCK) | (1 << ISP_MOSI);
+	ispGangEnable();
 
 	/* reset device */
 	ISP_OUT &= ~(1 << ISP_RST); /* RST low */
+	ispGangLow();
 	ISP_OUT &= ~(1 << ISP_SCK); /* SCK low */
 
 	/* positive reset pulse > 2 SCK (target) */
 	ispDelay();
 	ISP_OUT |= (1 << ISP_RST); /* RST high */
+	ispGangHigh();
 	ispDelay();
 	ISP_OUT &= ~(1 << ISP_RST); /* RST low */
+	ispGangLow();
 
 	if (ispTransmit == ispTransmit_hw) {
 		spiHWenable();
@@ -127,6 +225,27 @@ void ispConnect() {
 	
 	/* Initial extended address value */
 	isp_hiaddr = 0;
+
+	/* no write pending */
+	isp_wait = ISP_WAIT_NONE;
+}
+
+void ispResume() {
+
+	/* target is still in programming mode, no reset pulse */
+	ISP_DDR |= (1 << ISP_RST) | (1 << ISP_SCK) | (1 << ISP_MOSI);
+	ispGangEnable();
+	ISP_OUT &= ~((1 << ISP_RST) | (1 << ISP_SCK));
+	ispGangLow();
+
+	if (ispTransmit == ispTransmit_hw) {
+		spiHWenable();
+	} else {
+		spiHWdisable();
+	}
+
+	/* isp_hiaddr still matches the target */
+	isp_wait = ISP_WAIT_NONE;
 }
 
 void ispDisconnect() {
@@ -136,6 +255,12 @@ void ispDisconnect() {
 	/* switch pullups off */
 	ISP_OUT &= ~((1 << ISP_RST) | (1 << ISP_SCK) | (1 << ISP_MOSI));
 
+#ifdef ISP_WITH_GANG
+	/* release gang targets */
+	ISP_GANG_DDR &= ~ISP_GANG_MASK;
+	ISP_GANG_OUT &= ~ISP_GANG_MASK;
+#endif
+
 	/* disable hardware SPI */
 	spiHWdisable();
 }
@@ -179,10 +304,44 @@ uchar ispTransmit_hw(uchar send_byte) {
 	return SPDR;
 }
 
+uchar ispCommand(uchar cmd0, uchar cmd1, uchar cmd2, uchar cmd3) {
+	ispTransmit(cmd0);
+	ispTransmit(cmd1);
+	ispTransmit(cmd2);
+	return ispTransmit(cmd3);
+}
+
+/* look up write times of connected device by signature */
+static void ispSelectDevice() {
+	uchar sig1, sig2, i;
+
+	isp_flash_ticks = ISP_FLASH_TICKS;
+	isp_eeprom_ticks = ISP_EEPROM_TICKS;
+	isp_device_flags = 0;
+
+	/* several targets answer at once, keep the slowest times */
+	if (!ispGangSingle())
+		return;
+
+	sig1 = ispCommand(0x30, 0x00, 0x01, 0x00);
+	sig2 = ispCommand(0x30, 0x00, 0x02, 0x00);
+
+	for (i = 0; i < ISP_DEVICES; i++) {
+		if ((pgm_read_byte(&isp_devices[i].signature[0]) == sig1)
+				&& (pgm_read_byte(&isp_devices[i].signature[1]) == sig2)) {
+			isp_flash_ticks = pgm_read_byte(&isp_devices[i].flash_ticks);
+			isp_eeprom_ticks = pgm_read_byte(&isp_devices[i].eeprom_ticks);
+			isp_device_flags = pgm_read_byte(&isp_devices[i].flags);
+			return;
+		}
+	}
+}
+
 uchar ispEnterProgrammingMode() {
 	uchar check;
 	uchar count = 32;
 
+	isp_retries = 0;
 	while (count--) {
 		ispTransmit(0xAC);
 		ispTransmit(0x53);
@@ -190,16 +349,20 @@ uchar ispEnterProgrammingMode() {
 		ispTransmit(0);
 
 		if (check == 0x53) {
+			ispSelectDevice();
 			return 0;
 		}
+		isp_retries++;
 
 		spiHWdisable();
 
 		/* pulse RST */
 		ispDelay();
 		ISP_OUT |= (1 << ISP_RST); /* RST high */
+		ispGangHigh();
 		ispDelay();
 		ISP_OUT &= ~(1 << ISP_RST); /* RST low */
+		ispGangLow();
 		ispDelay();
 
 		if (ispTransmit == ispTransmit_hw) {
@@ -239,6 +402,62 @@ uchar ispReadFlash(unsigned long address) {
 	return ispTransmit(0);
 }
 
+/* start waiting, ticks * 320us */
+static void ispWaitStart(uchar mode, uchar ticks) {
+	isp_wait = mode;
+	isp_wait_ticks = ticks;
+	isp_wait_start = TIMERVALUE;
+}
+
+/* wait for flash at address to read other than value, max ticks * 320us */
+static void ispWaitPoll(unsigned long address, uchar value, uchar ticks) {
+	isp_wait_address = address;
+	isp_wait_value = value;
+	ispWaitStart(ISP_WAIT_POLL, ticks);
+}
+
+uchar ispPoll() {
+
+	if (isp_wait == ISP_WAIT_NONE)
+		return ISP_READY;
+
+	if ((isp_wait == ISP_WAIT_POLL)
+			&& (ispReadFlash(isp_wait_address) != isp_wait_value)) {
+		isp_wait = ISP_WAIT_NONE;
+		return ISP_READY;
+	}
+
+	if (isp_wait == ISP_WAIT_RDYBSY) {
+		ispTransmit(0xF0);
+		ispTransmit(0x00);
+		ispTransmit(0x00);
+		if ((ispTransmit(0x00) & 1) == 0) {
+			isp_wait = ISP_WAIT_NONE;
+			return ISP_READY;
+		}
+	}
+
+	if ((uint8_t) (TIMERVALUE - isp_wait_start) >= CLOCK_T_320us) {
+		isp_wait_start = TIMERVALUE;
+		if (--isp_wait_ticks == 0) {
+			/* time is up: fixed delay done, polling failed */
+			uchar mode = isp_wait;
+			isp_wait = ISP_WAIT_NONE;
+			return (mode == ISP_WAIT_TIME) ? ISP_READY : ISP_FAILED;
+		}
+	}
+
+	return ISP_BUSY;
+}
+
+uchar ispWait() {
+	uchar result;
+
+	while ((result = ispPoll()) == ISP_BUSY)
+		;
+	return result;
+}
+
 uchar ispWriteFlash(unsigned long address, uchar data, uchar pollmode) {
 
 	/* 0xFF is value after chip erase, so skip programming
@@ -257,28 +476,19 @@ uchar ispWriteFlash(unsigned long address, uchar data, uchar pollmode) {
 	if (pollmode == 0)
 		return 0;
 
-	if (data == 0x7F) {
-		clockWait(15); /* wait 4,8 ms */
-		return 0;
+	if (!ispGangSingle()) {
+		/* several targets answer at once, wait instead of polling */
+		ispWaitStart(ISP_WAIT_TIME, isp_flash_ticks);
+	} else if (isp_device_flags & ISP_DEVICE_RDYBSY) {
+		ispWaitStart(ISP_WAIT_RDYBSY, 2 * isp_flash_ticks);
+	} else if (data == 0x7F) {
+		ispWaitStart(ISP_WAIT_TIME, isp_flash_ticks);
 	} else {
-
 		/* polling flash */
-		uchar retries = 30;
-		uint8_t starttime = TIMERVALUE;
-		while (retries != 0) {
-			if (ispReadFlash(address) != 0x7F) {
-				return 0;
-			};
-
-			if ((uint8_t) (TIMERVALUE - starttime) > CLOCK_T_320us) {
-				starttime = TIMERVALUE;
-				retries--;
-			}
-
-		}
-		return 1; /* error */
+		ispWaitPoll(address, 0x7F, 30);
 	}
 
+	return 0;
 }
 
 uchar ispFlushPage(unsigned long address, uchar pollvalue) {
@@ -290,30 +500,18 @@ uchar ispFlushPage(unsigned long address, uchar pollvalue) {
 	ispTransmit(address >> 1);
 	ispTransmit(0);
 
-	if (pollvalue == 0xFF) {
-		clockWait(15);
-		return 0;
+	if (!ispGangSingle()) {
+		ispWaitStart(ISP_WAIT_TIME, isp_flash_ticks);
+	} else if (isp_device_flags & ISP_DEVICE_RDYBSY) {
+		ispWaitStart(ISP_WAIT_RDYBSY, 2 * isp_flash_ticks);
+	} else if (pollvalue == 0xFF) {
+		ispWaitStart(ISP_WAIT_TIME, isp_flash_ticks);
 	} else {
-
 		/* polling flash */
-		uchar retries = 30;
-		uint8_t starttime = TIMERVALUE;
-
-		while (retries != 0) {
-			if (ispReadFlash(address) != 0xFF) {
-				return 0;
-			};
-
-			if ((uint8_t) (TIMERVALUE - starttime) > CLOCK_T_320us) {
-				starttime = TIMERVALUE;
-				retries--;
-			}
-
-		}
-
-		return 1; /* error */
+		ispWaitPoll(address, 0xFF, 30);
 	}
 
+	return 0;
 }
 
 uchar ispReadEEPROM(unsigned int address) {
@@ -330,7 +528,11 @@ uchar ispWriteEEPROM(unsigned int address, uchar data) {
 	ispTransmit(address);
 	ispTransmit(data);
 
-	clockWait(30); // wait 9,6 ms
+	if ((isp_device_flags & ISP_DEVICE_RDYBSY) && ispGangSingle()) {
+		ispWaitStart(ISP_WAIT_RDYBSY, 2 * isp_eeprom_ticks);
+	} else {
+		ispWaitStart(ISP_WAIT_TIME, isp_eeprom_ticks);
+	}
 
 	return 0;
 }
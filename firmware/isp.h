@@ -24,9 +24,30 @@
 #define ISP_MISO  PB4
 #define ISP_SCK   PB5
 
+#ifdef ISP_WITH_GANG
+/* gang mode: PD3..PD7 are RST of further targets on the same MOSI, MISO
+   and SCK. isp_gang selects targets, bit 0 is ISP_RST, bit n > 0 is
+   PD(n + 2). Takes effect on ispConnect / ispResume */
+#define ISP_GANG_OUT   PORTD
+#define ISP_GANG_DDR   DDRD
+#define ISP_GANG_SHIFT 2
+#define ISP_GANG_MASK  ((1 << PD3) | (1 << PD4) | (1 << PD5) | (1 << PD6) | (1 << PD7))
+#define ISP_GANG_ALL   0x3F
+
+extern uchar isp_gang;
+
+/* target replies can only be read with one target selected */
+#define ispGangSingle() ((isp_gang & (isp_gang - 1)) == 0)
+#else
+#define ispGangSingle() 1
+#endif
+
 /* Prepare connection to target device */
 void ispConnect();
 
+/* Reconnect to a target kept in programming mode, call after ispSetSCKOption */
+void ispResume();
+
 /* Close connection to target device */
 void ispDisconnect();
 
@@ -39,12 +60,19 @@ uchar ispTransmit_hw(uchar send_byte);
 /* enter programming mode */
 uchar ispEnterProgrammingMode();
 
+/* failed attempts of last ispEnterProgrammingMode */
+extern uchar isp_retries;
+
+/* SCK option in use, USBASP_ISP_SCK_AUTO resolved */
+extern uchar isp_sck;
+
 /* read byte from eeprom at given address */
 uchar ispReadEEPROM(unsigned int address);
 
-/* write byte to flash at given address */
+/* write byte to flash at given address, pollmode 0 only loads page buffer */
 uchar ispWriteFlash(unsigned long address, uchar data, uchar pollmode);
 
+/* write loaded page to flash */
 uchar ispFlushPage(unsigned long address, uchar pollvalue);
 
 /* read byte from flash at given address */
@@ -53,9 +81,24 @@ uchar ispReadFlash(unsigned long address);
 /* write byte to eeprom at given address */
 uchar ispWriteEEPROM(unsigned int address, uchar data);
 
+/* ispPoll/ispWait results */
+#define ISP_READY   0
+#define ISP_FAILED  1
+#define ISP_BUSY    2
+
+/* check write started by ispWriteFlash, ispFlushPage or ispWriteEEPROM.
+   Those return at once, don't start the next write before this is ready */
+uchar ispPoll();
+
+/* wait until started write is done, ISP_READY or ISP_FAILED */
+uchar ispWait();
+
 /* pointer to sw or hw transmit function */
 uchar (*ispTransmit)(uchar);
 
+/* transmit 4 byte instruction, return last answer */
+uchar ispCommand(uchar cmd0, uchar cmd1, uchar cmd2, uchar cmd3);
+
 /* set SCK speed. call before ispConnect! */
 void ispSetSCKOption(uchar sckoption);
 
@@ -17,6 +17,8 @@
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
 #include <avr/wdt.h>
+#include <avr/eeprom.h>
+#include <util/crc16.h>
 
 #include "usbasp.h"
 #include "usbdrv.h"
@@ -24,8 +26,65 @@
 #include "clock.h"
 #include "tpi.h"
 #include "tpi_defs.h"
-
-static uchar replyBuffer[8];
+#include "script.h"
+#include "standalone.h"
+
+#ifndef MCUCSR
+#define MCUCSR MCUSR
+#endif
+
+static uchar replyBuffer[USBASP_SESSION_LEN];
+
+#if USB_CFG_IMPLEMENT_FN_WRITEOUT
+/* configuration descriptor, V-USB default plus interrupt-out endpoint 1 */
+PROGMEM const char usbDescriptorConfiguration[] = {
+	9, /* sizeof(usbDescriptorConfiguration) */
+	USBDESCR_CONFIG, /* descriptor type */
+	18 + 7 + 7 * USB_CFG_HAVE_INTRIN_ENDPOINT, 0, /* total length */
+	1, /* number of interfaces */
+	1, /* index of this configuration */
+	0, /* configuration name string index */
+	(1 << 7), /* attributes: bus powered */
+	USB_CFG_MAX_BUS_POWER / 2, /* max USB current in 2mA units */
+	/* interface descriptor */
+	9, /* sizeof(usbDescrInterface) */
+	USBDESCR_INTERFACE, /* descriptor type */
+	0, /* index of this interface */
+	0, /* alternate setting */
+	1 + USB_CFG_HAVE_INTRIN_ENDPOINT, /* number of endpoints excl. 0 */
+	USB_CFG_INTERFACE_CLASS,
+	USB_CFG_INTERFACE_SUBCLASS,
+	USB_CFG_INTERFACE_PROTOCOL,
+	0, /* string index for interface */
+#if USB_CFG_HAVE_INTRIN_ENDPOINT
+	/* endpoint descriptor for interrupt-in endpoint 1 */
+	7, /* sizeof(usbDescrEndpoint) */
+	USBDESCR_ENDPOINT, /* descriptor type */
+	(char) 0x81, /* IN endpoint number 1 */
+	0x03, /* attrib: interrupt endpoint */
+	8, 0, /* maximum packet size */
+	USB_CFG_INTR_POLL_INTERVAL, /* in ms */
+#endif
+	/* endpoint descriptor for interrupt-out endpoint 1 */
+	7, /* sizeof(usbDescrEndpoint) */
+	USBDESCR_ENDPOINT, /* descriptor type */
+	0x01, /* OUT endpoint number 1 */
+	0x03, /* attrib: interrupt endpoint */
+	8, 0, /* maximum packet size */
+	USB_CFG_INTR_POLL_INTERVAL, /* in ms */
+};
+#endif
+static uchar script_result[SCRIPT_RESULT_SIZE];
+
+/* programmer EEPROM: serial number length, then the characters */
+#define EEPROM_SERIAL 0
+/* settings of recently used targets, TARGET_SLOTS * TARGET_SIZE bytes */
+#define EEPROM_TARGET_TPI  14 /* slot of last TPI target */
+#define EEPROM_TARGET_NEXT 15 /* slot replaced next */
+#define EEPROM_TARGETS     16
+
+/* USB string descriptor of the serial number, built by serialLoad */
+static uchar serial_descr[2 + 2 * USBASP_SERIAL_MAX];
 
 static uchar prog_state = PROG_STATE_IDLE;
 static uchar prog_sck = USBASP_ISP_SCK_AUTO;
@@ -35,198 +94,1224 @@ static unsigned long prog_address;
 static unsigned int prog_nbytes = 0;
 static unsigned int prog_pagesize;
 static uchar prog_blockflags;
-static uchar prog_pagecounter;
+static unsigned int prog_pagecounter;
+static uchar prog_page_dirty; /* page buffer holds data to flush */
+static uchar prog_update_failed; /* update mode: page needs erase */
+
+static uchar prog_errcount;
+/* GETSTATUS reply: count, then failing addresses */
+static uchar prog_errlist[1 + 4 * USBASP_STATUS_ERRORS];
 
-uchar usbFunctionSetup(uchar data[8]) {
+/* build serial number descriptor from EEPROM, "0000" if not set */
+static void serialLoad() {
+	uchar i, len;
 
-	uchar len = 0;
+	len = eeprom_read_byte((uchar *) EEPROM_SERIAL);
+	if ((len == 0) || (len > USBASP_SERIAL_MAX)) {
+		len = 4;
+		for (i = 0; i < len; i++) {
+			serial_descr[2 + 2 * i] = '0';
+		}
+	} else {
+		for (i = 0; i < len; i++) {
+			serial_descr[2 + 2 * i] = eeprom_read_byte(
+					(uchar *) EEPROM_SERIAL + 1 + i);
+		}
+	}
+	for (i = 0; i < len; i++) {
+		serial_descr[3 + 2 * i] = 0;
+	}
+	serial_descr[0] = 2 + 2 * len;
+	serial_descr[1] = USBDESCR_STRING;
+}
 
-	if (data[1] == USBASP_FUNC_CONNECT) {
+/* only the serial number string is dynamic, see usbconfig.h */
+usbMsgLen_t usbFunctionDescriptor(usbRequest_t *rq) {
+	usbMsgPtr = serial_descr;
+	return serial_descr[0];
+}
 
-		/* set SCK speed */
-		if ((PINC & (1 << PC2)) == 0) {
-			ispSetSCKOption(USBASP_ISP_SCK_8);
+/* programming engine: data between USB and target is queued in prog_buf,
+   the target side is worked off by progPoll from the main loop.
+   Size is a power of 2 up to 128: 32, 64 or 128 bytes */
+#define PROG_BUF_SIZE (32 << USBASP_RAM_SCALE)
+static uchar prog_buf[PROG_BUF_SIZE];
+static uchar prog_buf_rd;
+static uchar prog_buf_cnt;
+
+static uchar job_state = PROG_STATE_IDLE;
+static unsigned long job_address;
+static unsigned int job_nbytes;
+static uchar job_busy; /* target write in progress */
+static unsigned long job_busy_address;
+static uchar job_source; /* where ISP writes take their data from */
+
+/* ISP write data sources */
+#define PROG_SOURCE_BUF 0 /* plain bytes from prog_buf */
+#define PROG_SOURCE_RLE 1 /* run length coded bytes from prog_buf */
+#define PROG_SOURCE_FILL 2 /* repeated fill_pattern */
+
+/* RLE decoder state */
+static uchar rle_count; /* bytes left in current run */
+static uchar rle_literal;
+static uchar rle_value;
+static uchar rle_end; /* no more input will arrive */
+
+/* pattern fill: memory type and pattern as received */
+static uchar fill_pattern[1 + USBASP_FILL_MAX];
+static uchar fill_len;
+static uchar fill_index;
+static unsigned int fill_nbytes;
+
+#define progBufAt(i)  prog_buf[(prog_buf_rd + (i)) & (PROG_BUF_SIZE - 1)]
+#define progBufFree() (PROG_BUF_SIZE - prog_buf_cnt)
+
+/* remember first USBASP_STATUS_ERRORS failing addresses, count saturates
+   at 255 */
+static void progError(unsigned long address) {
+	uchar *p;
+
+	if (prog_errcount < USBASP_STATUS_ERRORS) {
+		p = &prog_errlist[1 + 4 * prog_errcount];
+		p[0] = address;
+		p[1] = address >> 8;
+		p[2] = address >> 16;
+		p[3] = address >> 24;
+	}
+	if (prog_errcount != 0xff) {
+		prog_errcount++;
+	}
+}
+
+static void progBufPut(uchar data) {
+	progBufAt(prog_buf_cnt) = data;
+	prog_buf_cnt++;
+}
+
+static uchar progBufGet(void) {
+	uchar data = prog_buf[prog_buf_rd];
+	prog_buf_rd = (prog_buf_rd + 1) & (PROG_BUF_SIZE - 1);
+	prog_buf_cnt--;
+
+	/* room for next packet again, checked on every path that consumes
+	   buffered data */
+	if (usbAllRequestsAreDisabled() && (progBufFree() >= 8)) {
+		usbEnableAllRequests();
+	}
+	return data;
+}
+
+/* hand current transfer over to the engine */
+static void progStart(uchar state) {
+	prog_state = state;
+	job_state = state;
+	job_address = prog_address;
+	job_nbytes = prog_nbytes;
+	job_source = PROG_SOURCE_BUF;
+	rle_count = 0;
+	rle_end = 0;
+}
+
+/* expand next byte of USBASP_RLE_* coded data, 0 if input is missing */
+static uchar progRLEGet(uchar *data) {
+	uchar c;
+
+	if (rle_count == 0) {
+		if (prog_buf_cnt == 0)
+			goto missing;
+		c = progBufAt(0);
+		if (c & USBASP_RLE_REPEAT) {
+			/* repeat run, value byte follows */
+			if (prog_buf_cnt < 2)
+				goto missing;
+			progBufGet();
+			rle_value = progBufGet();
+			rle_count = (c & ~USBASP_RLE_REPEAT) + 2;
+			rle_literal = 0;
 		} else {
-			ispSetSCKOption(prog_sck);
+			/* literal run */
+			progBufGet();
+			rle_count = c + 1;
+			rle_literal = 1;
 		}
+	}
 
-		/* set compatibility mode of address delivering */
-		prog_address_newmode = 0;
+	if (rle_literal) {
+		if (prog_buf_cnt == 0)
+			goto missing;
+		rle_value = progBufGet();
+	}
+	*data = rle_value;
+	rle_count--;
+	return 1;
+
+missing:
+	/* transfer ended early, stop the job */
+	if (rle_end)
+		job_nbytes = 0;
+	return 0;
+}
 
-		ledRedOn();
-		ispConnect();
+/* next data byte for ISP writes, 0 if none available yet */
+static uchar progSourceGet(uchar *data) {
+
+	if (job_source == PROG_SOURCE_RLE)
+		return progRLEGet(data);
+
+	if (job_source == PROG_SOURCE_FILL) {
+		*data = fill_pattern[1 + fill_index];
+		if (++fill_index == fill_len)
+			fill_index = 0;
+		return 1;
+	}
+
+	if (prog_buf_cnt == 0)
+		return 0;
+	*data = progBufGet();
+	return 1;
+}
+
+/* queue data from host for progPoll, return 1 on last packet */
+static uchar progQueue(uchar *data, uchar len) {
+	uchar i;
+
+	for (i = 0; i < len; i++) {
+		progBufPut(data[i]);
+	}
+
+	/* coded data: address already advanced by the expanded length */
+	if (job_source != PROG_SOURCE_RLE)
+		prog_address += len;
+	prog_nbytes -= len;
+
+	if (prog_nbytes == 0) {
+		prog_state = PROG_STATE_IDLE;
+		return 1; // Need to return 1 when no more data is to be received
+	}
+
+	/* no room for next packet: NAK until progPoll has worked it off */
+	if (progBufFree() < 8) {
+		usbDisableAllRequests();
+	}
 
-	} else if (data[1] == USBASP_FUNC_DISCONNECT) {
+	return 0;
+}
+
+#if USB_CFG_HAVE_INTRIN_ENDPOINT
+/* push prefetched data to interrupt-in endpoint 1 when host has fetched
+   the previous packet */
+static void progStreamPoll(void) {
+	uchar packet[8];
+	uchar i, len;
+
+	if ((prog_state != PROG_STATE_STREAMREAD) || !usbInterruptIsReady())
+		return;
+
+	len = sizeof(packet);
+	if (prog_nbytes < len)
+		len = prog_nbytes;
+	if (prog_buf_cnt < len)
+		return;
+
+	for (i = 0; i < len; i++) {
+		packet[i] = progBufGet();
+	}
+	usbSetInterrupt(packet, len);
+
+	prog_address += len;
+	prog_nbytes -= len;
+	if (prog_nbytes == 0) {
+		prog_state = PROG_STATE_IDLE;
+	}
+}
+#endif
+
+/* update mode, at page start: compare the whole page with flash before
+   any of it is loaded, a page needing a bit set is not written at all.
+   0 if the page is not buffered yet. It fits (progUpdateReject), and with
+   8 byte packets requests are only disabled when prog_buf is full */
+static uchar progUpdateCheck(void) {
+	unsigned int i, n;
+	uchar old, data;
+
+	if (prog_update_failed)
+		return 1;
+
+	n = prog_pagesize;
+	if (n > job_nbytes)
+		n = job_nbytes;
+	if (prog_buf_cnt < n)
+		return 0;
+
+	for (i = 0; i < n; i++) {
+		old = ispReadFlash(job_address + i);
+		data = progBufAt(i);
+		if ((old & data) != data) {
+			progError(job_address + i);
+			prog_update_failed = 1;
+			prog_page_dirty = 0;
+			break;
+		}
+		if (old != data)
+			prog_page_dirty = 1;
+	}
+	return 1;
+}
+
+/* do one step of current job, never waits for the target */
+static void progPoll(void) {
+	uchar data;
+
+	/* target still writing? */
+	if (job_busy) {
+		if (job_state == PROG_STATE_TPI_WRITE) {
+			if (tpi_nvm_busy())
+				return;
+		} else {
+			data = ispPoll();
+			if (data == ISP_BUSY)
+				return;
+			if (data == ISP_FAILED)
+				progError(job_busy_address);
+		}
+		job_busy = 0;
+	}
+
+	if (job_nbytes == 0) {
+		/* coded data that expands beyond wValue is dropped, also what
+		   still arrives of this transfer */
+		if (job_source == PROG_SOURCE_RLE) {
+			while (prog_buf_cnt)
+				progBufGet();
+		}
+		job_state = PROG_STATE_IDLE;
+		return;
+	}
+
+	if ((job_state == PROG_STATE_READFLASH) || (job_state
+			== PROG_STATE_READEEPROM) || (job_state == PROG_STATE_TPI_READ)) {
+
+		/* prefetch for usbFunctionRead */
+		if (progBufFree() == 0)
+			return;
+
+		if (job_state == PROG_STATE_READFLASH) {
+			data = ispReadFlash(job_address);
+		} else if (job_state == PROG_STATE_READEEPROM) {
+			data = ispReadEEPROM(job_address);
+		} else {
+			tpi_read_block(job_address, &data, 1);
+		}
+		progBufPut(data);
+
+	} else {
+
+		if (job_state == PROG_STATE_TPI_WRITE) {
+
+			if (prog_buf_cnt == 0)
+				return;
+
+			/* sparse mode: word still erased after chip erase, skip it */
+			if ((prog_blockflags & PROG_BLOCKFLAG_SPARSE) && !(job_address & 1)
+					&& (job_nbytes >= 2) && (progBufAt(0) == 0xFF)) {
+				/* wait for high byte */
+				if (prog_buf_cnt < 2)
+					return;
+				if (progBufAt(1) == 0xFF) {
+					/* PR is reloaded on next write, cache no longer matches */
+					progBufGet();
+					progBufGet();
+					job_address += 2;
+					job_nbytes -= 2;
+					return;
+				}
+			}
+
+			tpi_pr_update(job_address, 1);
+			tpi_write_byte(progBufGet());
+			job_busy = 1;
+
+		} else {
+
+			/* update mode: check whole page before loading any of it */
+			if ((job_state == PROG_STATE_WRITEFLASH)
+					&& (prog_blockflags & PROG_BLOCKFLAG_UPDATE)
+					&& (prog_pagecounter == prog_pagesize) && !progUpdateCheck())
+				return;
+
+			if (!progSourceGet(&data))
+				return;
+
+			if (job_state == PROG_STATE_WRITEFLASH) {
+				/* Flash */
+
+				if (prog_pagesize == 0) {
+					/* not paged */
+					ispWriteFlash(job_address, data, 1);
+					job_busy = 1;
+				} else {
+					/* paged */
+					if (!(prog_blockflags & PROG_BLOCKFLAG_UPDATE)) {
+						ispWriteFlash(job_address, data, 0);
+						prog_page_dirty = 1;
+					} else if (!prog_update_failed) {
+						/* page passed progUpdateCheck: loading bytes equal to
+						   flash leaves them unchanged */
+						ispWriteFlash(job_address, data, 0);
+					}
+					prog_pagecounter--;
+					if (prog_pagecounter == 0) {
+						if (prog_page_dirty) {
+							ispFlushPage(job_address, data);
+							job_busy = 1;
+						}
+						prog_pagecounter = prog_pagesize;
+						prog_page_dirty = 0;
+					}
+				}
+
+			} else {
+				/* EEPROM */
+				ispWriteEEPROM(job_address, data);
+				job_busy = 1;
+			}
+
+			if ((job_nbytes == 1) && (prog_blockflags & PROG_BLOCKFLAG_LAST)
+					&& (prog_pagecounter != prog_pagesize) && prog_page_dirty) {
+
+				/* last block and page flush pending, so flush it now */
+				ispFlushPage(job_address, data);
+				prog_page_dirty = 0;
+				job_busy = 1;
+			}
+		}
+	}
+
+	if (job_busy)
+		job_busy_address = job_address;
+
+	job_address++;
+	job_nbytes--;
+}
+
+/* complete queued writes, drop prefetched read data */
+static void progFlush(void) {
+
+	/* previous transfer is over or was abandoned by the host */
+	prog_state = PROG_STATE_IDLE;
+
+	if (job_state == PROG_STATE_IDLE)
+		return;
+
+	/* nothing more will arrive for an interrupted transfer */
+	if (job_source == PROG_SOURCE_RLE) {
+		/* expanded size is unknown, decoder stops at end of input */
+		rle_end = 1;
+	} else if (job_source == PROG_SOURCE_BUF) {
+		job_nbytes = prog_buf_cnt;
+	}
+	if ((job_state == PROG_STATE_READFLASH) || (job_state
+			== PROG_STATE_READEEPROM) || (job_state == PROG_STATE_TPI_READ)) {
+		job_nbytes = 0;
+	}
+
+	while (job_state != PROG_STATE_IDLE) {
+		progPoll();
+	}
+
+	prog_buf_cnt = 0;
+	if (usbAllRequestsAreDisabled()) {
+		usbEnableAllRequests();
+	}
+}
+
+/* CRC-CCITT (start value 0xFFFF) of target memory read over TPI */
+static unsigned int tpiChecksum(unsigned int address, unsigned int nbytes) {
+	unsigned int crc = 0xFFFF;
+	uchar i, len;
+
+	while (nbytes) {
+		len = sizeof(replyBuffer);
+		if (nbytes < len)
+			len = nbytes;
+
+		tpi_read_block(address, replyBuffer, len);
+		for (i = 0; i < len; i++) {
+			crc = _crc_ccitt_update(crc, replyBuffer[i]);
+		}
+
+		address += len;
+		nbytes -= len;
+	}
+
+	return crc;
+}
+
+/* hold mode: after DISCONNECT the target stays in programming mode */
+static uchar prog_hold; /* seconds left, 0 = off */
+static unsigned int prog_hold_ovf; /* timer overflows left in this second */
+static uchar prog_hold_signature[3];
+
+static void progHoldStart(uchar seconds) {
+	uchar i;
+
+	for (i = 0; i < 3; i++) {
+		prog_hold_signature[i] = ispCommand(0x30, 0x00, i, 0x00);
+	}
+	prog_hold = seconds;
+	prog_hold_ovf = CLOCK_OVF_PER_SEC;
+	TIFR0 = (1 << TOV0);
+}
+
+static void progHoldEnd() {
+	if (prog_hold) {
+		prog_hold = 0;
 		ispDisconnect();
 		ledRedOff();
+	}
+}
 
-	} else if (data[1] == USBASP_FUNC_TRANSMIT) {
-		replyBuffer[0] = ispTransmit(data[2]);
-		replyBuffer[1] = ispTransmit(data[3]);
-		replyBuffer[2] = ispTransmit(data[4]);
-		replyBuffer[3] = ispTransmit(data[5]);
-		len = 4;
+/* count down hold time, called from main loop. Overflows missed during
+   long requests only make the timeout longer */
+static void progHoldPoll() {
+	if (prog_hold && (TIFR0 & (1 << TOV0))) {
+		TIFR0 = (1 << TOV0);
+		if (--prog_hold_ovf == 0) {
+			prog_hold_ovf = CLOCK_OVF_PER_SEC;
+			if (prog_hold == 1) {
+				progHoldEnd();
+			} else {
+				prog_hold--;
+			}
+		}
+	}
+}
 
-	} else if (data[1] == USBASP_FUNC_READFLASH) {
+/* take over held target if it is still the same device */
+static uchar progHoldResume() {
+	uchar i;
 
-		if (!prog_address_newmode)
-			prog_address = (data[3] << 8) | data[2];
+	if (!prog_hold)
+		return 0;
 
-		prog_nbytes = (data[7] << 8) | data[6];
-		prog_state = PROG_STATE_READFLASH;
-		len = 0xff; /* multiple in */
+	prog_hold = 0;
+	ispResume();
+	for (i = 0; i < 3; i++) {
+		if (ispCommand(0x30, 0x00, i, 0x00) != prog_hold_signature[i])
+			return 0;
+	}
+	return 1;
+}
 
-	} else if (data[1] == USBASP_FUNC_READEEPROM) {
+/* target settings cache entry: signature, then what worked last time */
+#define TARGET_SLOTS    8
+#define TARGET_SIZE     8
+#define TARGET_SCK      3 /* USBASP_ISP_SCK_* */
+#define TARGET_TPI_DLY  4 /* tpi_dly_cnt, 2 bytes */
+/* bytes 6 and 7 reserved */
 
-		if (!prog_address_newmode)
-			prog_address = (data[3] << 8) | data[2];
+static uchar target[TARGET_SIZE]; /* entry of connected target */
+static uchar target_slot; /* its slot, 0xff if new */
 
-		prog_nbytes = (data[7] << 8) | data[6];
-		prog_state = PROG_STATE_READEEPROM;
-		len = 0xff; /* multiple in */
+#define targetAddress(slot) ((uchar *) EEPROM_TARGETS + (slot) * TARGET_SIZE)
 
-	} else if (data[1] == USBASP_FUNC_ENABLEPROG) {
-		replyBuffer[0] = ispEnterProgrammingMode();
-		len = 1;
+/* load cached settings of target with signature sig */
+static void targetLoad(uchar *sig) {
+	uchar i;
 
-	} else if (data[1] == USBASP_FUNC_WRITEFLASH) {
+	for (target_slot = 0; target_slot < TARGET_SLOTS; target_slot++) {
+		eeprom_read_block(target, targetAddress(target_slot), TARGET_SIZE);
+		if ((target[0] == sig[0]) && (target[1] == sig[1])
+				&& (target[2] == sig[2]))
+			return;
+	}
 
-		if (!prog_address_newmode)
-			prog_address = (data[3] << 8) | data[2];
+	/* unknown target */
+	target_slot = 0xff;
+	for (i = 0; i < TARGET_SIZE; i++) {
+		target[i] = 0xff;
+	}
+	target[0] = sig[0];
+	target[1] = sig[1];
+	target[2] = sig[2];
+}
+
+/* write back entry, only changed bytes to spare the EEPROM */
+static void targetStore() {
+
+	if (target_slot == 0xff) {
+		target_slot = eeprom_read_byte((uchar *) EEPROM_TARGET_NEXT)
+				% TARGET_SLOTS;
+		eeprom_update_byte((uchar *) EEPROM_TARGET_NEXT, target_slot + 1);
+	}
+	eeprom_update_block(target, targetAddress(target_slot), TARGET_SIZE);
+}
+
+/* enter programming mode. With SCK option auto a cached faster SCK is
+   tried. The fastest SCK that worked is remembered for this target */
+static uchar progEnable() {
+	uchar sig[3], sck, i;
+
+	if (ispEnterProgrammingMode())
+		return 1;
+
+	/* jumper forces slow SCK, leave the cache alone */
+	if ((PINC & (1 << PC2)) == 0)
+		return 0;
+
+	/* several targets answer at once, signature reads are not reliable */
+	if (!ispGangSingle())
+		return 0;
 
-		prog_pagesize = data[4];
-		prog_blockflags = data[5] & 0x0F;
-		prog_pagesize += (((unsigned int) data[5] & 0xF0) << 4);
-		if (prog_blockflags & PROG_BLOCKFLAG_FIRST) {
-			prog_pagecounter = prog_pagesize;
+	for (i = 0; i < 3; i++) {
+		sig[i] = ispCommand(0x30, 0x00, i, 0x00);
+	}
+	targetLoad(sig);
+
+	if ((prog_sck == USBASP_ISP_SCK_AUTO) && (target[TARGET_SCK]
+			<= USBASP_ISP_SCK_1500) && (target[TARGET_SCK] > isp_sck)) {
+		sck = isp_sck;
+		ispSetSCKOption(target[TARGET_SCK]);
+		ispResume();
+		for (i = 0; i < 3; i++) {
+			if (ispCommand(0x30, 0x00, i, 0x00) != sig[i]) {
+				/* does not work anymore, e.g. target clock changed.
+				   Too fast SCK may have put the target out of step, so
+				   start over */
+				ispSetSCKOption(sck);
+				ispConnect();
+				if (ispEnterProgrammingMode())
+					return 1;
+				target[TARGET_SCK] = sck;
+				break;
+			}
 		}
-		prog_nbytes = (data[7] << 8) | data[6];
-		prog_state = PROG_STATE_WRITEFLASH;
-		len = 0xff; /* multiple out */
+	}
 
-	} else if (data[1] == USBASP_FUNC_WRITEEEPROM) {
+	/* a session with slower SCK set by the host keeps the cached one */
+	if ((target[TARGET_SCK] > USBASP_ISP_SCK_1500)
+			|| (isp_sck > target[TARGET_SCK]))
+		target[TARGET_SCK] = isp_sck;
+	targetStore();
+	return 0;
+}
 
-		if (!prog_address_newmode)
-			prog_address = (data[3] << 8) | data[2];
+static usbMsgLen_t cmdConnect(uchar *data) {
 
-		prog_pagesize = 0;
-		prog_blockflags = 0;
-		prog_nbytes = (data[7] << 8) | data[6];
-		prog_state = PROG_STATE_WRITEEEPROM;
-		len = 0xff; /* multiple out */
+	/* set SCK speed */
+	if ((PINC & (1 << PC2)) == 0) {
+		ispSetSCKOption(USBASP_ISP_SCK_8);
+	} else {
+		ispSetSCKOption(prog_sck);
+	}
 
-	} else if (data[1] == USBASP_FUNC_SETLONGADDRESS) {
+	/* set compatibility mode of address delivering */
+	prog_address_newmode = 0;
 
-		/* set new mode of address delivering (ignore address delivered in commands) */
-		prog_address_newmode = 1;
-		/* set new address */
-		prog_address = *((unsigned long*) &data[2]);
+	prog_errcount = 0;
 
-	} else if (data[1] == USBASP_FUNC_SETISPSCK) {
+	ledRedOn();
+	if (!progHoldResume())
+		ispConnect();
+	return 0;
+}
 
-		/* set sck option */
-		prog_sck = data[2];
-		replyBuffer[0] = 0;
-		len = 1;
+static usbMsgLen_t cmdDisconnect(uchar *data) {
 
-	} else if (data[1] == USBASP_FUNC_TPI_CONNECT) {
-		tpi_dly_cnt = data[2] | (data[3] << 8);
+	/* wValue low byte: keep target in programming mode for n seconds */
+	if (data[2] != 0) {
+		progHoldStart(data[2]);
+		return 0;
+	}
 
-		/* RST high */
-		ISP_OUT |= (1 << ISP_RST);
-		ISP_DDR |= (1 << ISP_RST);
+	progHoldEnd();
+	ispDisconnect();
+	ledRedOff();
+	return 0;
+}
 
-		clockWait(3);
+static usbMsgLen_t cmdTransmit(uchar *data) {
+	replyBuffer[0] = ispTransmit(data[2]);
+	replyBuffer[1] = ispTransmit(data[3]);
+	replyBuffer[2] = ispTransmit(data[4]);
+	replyBuffer[3] = ispTransmit(data[5]);
+	return 4;
+}
 
-		/* RST low */
-		ISP_OUT &= ~(1 << ISP_RST);
-		ledRedOn();
+/* page size and block flags from wIndex of flash write requests */
+static void progSetPaging(uchar *data) {
+	prog_pagesize = data[4];
+	prog_blockflags = data[5] & 0x0F;
+	prog_pagesize += (((unsigned int) data[5] & 0xF0) << 4);
+	if (prog_blockflags & PROG_BLOCKFLAG_FIRST) {
+		prog_pagecounter = prog_pagesize;
+		prog_page_dirty = 0;
+		prog_update_failed = 0;
+	}
+}
 
-		clockWait(16);
-		tpi_init();
-	
-	} else if (data[1] == USBASP_FUNC_TPI_DISCONNECT) {
+/* update mode needs page aligned blocks of whole pages (except the last
+   block) that fit in prog_buf. Reports an error and returns 1 if the
+   block can't be done that way */
+static uchar progUpdateReject(uchar plain) {
 
-		tpi_send_byte(TPI_OP_SSTCS(TPISR));
-		tpi_send_byte(0);
+	if (!(prog_blockflags & PROG_BLOCKFLAG_UPDATE))
+		return 0;
 
-		clockWait(10);
+	if (plain && (prog_pagesize != 0) && (prog_pagesize <= PROG_BUF_SIZE)
+			&& (prog_pagecounter == prog_pagesize)
+			&& ((prog_nbytes % prog_pagesize == 0)
+					|| (prog_blockflags & PROG_BLOCKFLAG_LAST)))
+		return 0;
 
-		/* pulse RST */
-		ISP_OUT |= (1 << ISP_RST);
-		clockWait(5);
-		ISP_OUT &= ~(1 << ISP_RST);
-		clockWait(5);
+	progError(prog_address);
+	prog_update_failed = 1;
+	return 1;
+}
 
-		/* set all ISP pins inputs */
-		ISP_DDR &= ~((1 << ISP_RST) | (1 << ISP_SCK) | (1 << ISP_MOSI));
-		/* switch pullups off */
-		ISP_OUT &= ~((1 << ISP_RST) | (1 << ISP_SCK) | (1 << ISP_MOSI));
+static usbMsgLen_t cmdReadFlash(uchar *data) {
 
-		ledRedOff();
-	
-	} else if (data[1] == USBASP_FUNC_TPI_RAWREAD) {
-		replyBuffer[0] = tpi_recv_byte();
-		len = 1;
-	
-	} else if (data[1] == USBASP_FUNC_TPI_RAWWRITE) {
-		tpi_send_byte(data[2]);
-	
-	} else if (data[1] == USBASP_FUNC_TPI_READBLOCK) {
+	if (!prog_address_newmode)
 		prog_address = (data[3] << 8) | data[2];
-		prog_nbytes = (data[7] << 8) | data[6];
-		prog_state = PROG_STATE_TPI_READ;
-		len = 0xff; /* multiple in */
-	
-	} else if (data[1] == USBASP_FUNC_TPI_WRITEBLOCK) {
+
+	prog_nbytes = (data[7] << 8) | data[6];
+	progStart(PROG_STATE_READFLASH);
+	return USB_NO_MSG; /* multiple in */
+}
+
+static usbMsgLen_t cmdEnableProg(uchar *data) {
+	replyBuffer[0] = progEnable();
+	return 1;
+}
+
+static usbMsgLen_t cmdWriteFlash(uchar *data) {
+
+	if (!prog_address_newmode)
 		prog_address = (data[3] << 8) | data[2];
-		prog_nbytes = (data[7] << 8) | data[6];
-		prog_state = PROG_STATE_TPI_WRITE;
-		len = 0xff; /* multiple out */
-	
-	} else if (data[1] == USBASP_FUNC_GETCAPABILITIES) {
-		replyBuffer[0] = USBASP_CAP_0_TPI;
-		replyBuffer[1] = 0;
-		replyBuffer[2] = 0;
-		replyBuffer[3] = 0;
-		len = 4;
+
+	progSetPaging(data);
+	prog_nbytes = (data[7] << 8) | data[6];
+	if (progUpdateReject(1))
+		return 0;
+	progStart(PROG_STATE_WRITEFLASH);
+	return USB_NO_MSG; /* multiple out */
+}
+
+static usbMsgLen_t cmdWriteFlashRLE(uchar *data) {
+
+	/* like WRITEFLASH, but run length coded data. wValue holds the
+	   expanded length, so the address is taken from SETLONGADDRESS */
+	if (!prog_address_newmode)
+		prog_address = 0;
+
+	progSetPaging(data);
+	prog_nbytes = (data[3] << 8) | data[2];
+	if (progUpdateReject(0))
+		return 0;
+	progStart(PROG_STATE_WRITEFLASH);
+	job_source = PROG_SOURCE_RLE;
+	prog_address += prog_nbytes;
+
+	/* coded bytes still to receive */
+	prog_nbytes = (data[7] << 8) | data[6];
+	return USB_NO_MSG; /* multiple out */
+}
+
+static usbMsgLen_t cmdFill(uchar *data) {
+
+	/* length in wValue, address from SETLONGADDRESS, memory and pattern
+	   follow in the data stage */
+	if (!prog_address_newmode)
+		prog_address = 0;
+
+	progSetPaging(data);
+	fill_nbytes = (data[3] << 8) | data[2];
+	fill_len = 0;
+	if (progUpdateReject(0))
+		return 0;
+
+	prog_nbytes = (data[7] << 8) | data[6];
+	if ((prog_nbytes < 2) || (prog_nbytes > sizeof(fill_pattern)))
+		return 0;
+
+	prog_state = PROG_STATE_FILL;
+	return USB_NO_MSG; /* multiple out */
+}
+
+static usbMsgLen_t cmdReadEEPROM(uchar *data) {
+
+	if (!prog_address_newmode)
+		prog_address = (data[3] << 8) | data[2];
+
+	prog_nbytes = (data[7] << 8) | data[6];
+	progStart(PROG_STATE_READEEPROM);
+	return USB_NO_MSG; /* multiple in */
+}
+
+static usbMsgLen_t cmdWriteEEPROM(uchar *data) {
+
+	if (!prog_address_newmode)
+		prog_address = (data[3] << 8) | data[2];
+
+	prog_pagesize = 0;
+	prog_blockflags = 0;
+	prog_nbytes = (data[7] << 8) | data[6];
+	progStart(PROG_STATE_WRITEEEPROM);
+	return USB_NO_MSG; /* multiple out */
+}
+
+static usbMsgLen_t cmdSetLongAddress(uchar *data) {
+
+	/* set new mode of address delivering (ignore address delivered in commands) */
+	prog_address_newmode = 1;
+	/* set new address */
+	prog_address = *((unsigned long*) &data[2]);
+	return 0;
+}
+
+static usbMsgLen_t cmdSetISPSCK(uchar *data) {
+
+	/* set sck option */
+	prog_sck = data[2];
+	replyBuffer[0] = 0;
+	return 1;
+}
+
+/* a slow TPI bit in tpi.S takes about TPI_BIT_CYCLES + 8 * tpi_dly_cnt
+   cycles. Host delay counts are meant for 12MHz, convert them so the bit
+   time stays the same at F_CPU, rounded to the slower side */
+#define TPI_BIT_CYCLES  40
+
+static unsigned int tpiDelay(unsigned int cnt) {
+	unsigned long n;
+
+	if (cnt == USBASP_TPI_DLY_FAST)
+		return cnt;
+	n = ((unsigned long) cnt * 8 + TPI_BIT_CYCLES) * (F_CPU / 1000000L);
+	n = (n + 95) / 96 - TPI_BIT_CYCLES / 8;
+	if (n >= USBASP_TPI_DLY_AUTO)
+		n = USBASP_TPI_DLY_AUTO - 1;
+	return n;
+}
+
+static usbMsgLen_t cmdTPIConnect(uchar *data) {
+	uchar slot;
+
+	progHoldEnd();
+	tpi_dly_cnt = data[2] | (data[3] << 8);
+
+	/* auto: the signature can't be read before NVM programming is enabled,
+	   so take the delay that worked with the last TPI target, cached
+	   already converted to F_CPU */
+	if (tpi_dly_cnt == USBASP_TPI_DLY_AUTO) {
+		tpi_dly_cnt = tpiDelay(USBASP_TPI_DLY_DEFAULT);
+		slot = eeprom_read_byte((uchar *) EEPROM_TARGET_TPI);
+		if (slot < TARGET_SLOTS) {
+			eeprom_read_block(target, targetAddress(slot), TARGET_SIZE);
+			if (target[TARGET_TPI_DLY + 1] != 0xff) {
+				tpi_dly_cnt = target[TARGET_TPI_DLY]
+						| (target[TARGET_TPI_DLY + 1] << 8);
+			}
+		}
+	} else {
+		tpi_dly_cnt = tpiDelay(tpi_dly_cnt);
+	}
+
+	/* RST high */
+	ISP_OUT |= (1 << ISP_RST);
+	ISP_DDR |= (1 << ISP_RST);
+
+	clockWait(3);
+
+	/* RST low */
+	ISP_OUT &= ~(1 << ISP_RST);
+	ledRedOn();
+
+	clockWait(16);
+	tpi_init();
+
+	prog_errcount = 0;
+	return 0;
+}
+
+static usbMsgLen_t cmdTPIDisconnect(uchar *data) {
+	uchar sig[3];
+
+	/* remember delay if the signature reads back, i.e. the session worked */
+	tpi_read_block(TPI_SIGNATURE, sig, 3);
+	if (sig[0] == 0x1E) {
+		targetLoad(sig);
+		target[TARGET_TPI_DLY] = tpi_dly_cnt;
+		target[TARGET_TPI_DLY + 1] = tpi_dly_cnt >> 8;
+		targetStore();
+		eeprom_update_byte((uchar *) EEPROM_TARGET_TPI, target_slot);
+	}
+
+	tpi_send_byte(TPI_OP_SSTCS(TPISR));
+	tpi_send_byte(0);
+
+	clockWait(10);
+
+	/* pulse RST */
+	ISP_OUT |= (1 << ISP_RST);
+	clockWait(5);
+	ISP_OUT &= ~(1 << ISP_RST);
+	clockWait(5);
+
+	/* set all ISP pins inputs */
+	ISP_DDR &= ~((1 << ISP_RST) | (1 << ISP_SCK) | (1 << ISP_MOSI));
+	/* switch pullups off */
+	ISP_OUT &= ~((1 << ISP_RST) | (1 << ISP_SCK) | (1 << ISP_MOSI));
+
+	ledRedOff();
+	return 0;
+}
+
+static usbMsgLen_t cmdTPIRawRead(uchar *data) {
+	replyBuffer[0] = tpi_recv_byte();
+	return 1;
+}
+
+static usbMsgLen_t cmdTPIRawWrite(uchar *data) {
+	/* host may change PR with raw instructions */
+	tpi_pr_valid = 0;
+	tpi_send_byte(data[2]);
+	return 0;
+}
+
+static usbMsgLen_t cmdTPIReadBlock(uchar *data) {
+	prog_address = (data[3] << 8) | data[2];
+	prog_nbytes = (data[7] << 8) | data[6];
+	progStart(PROG_STATE_TPI_READ);
+	return USB_NO_MSG; /* multiple in */
+}
+
+static usbMsgLen_t cmdTPIWriteBlock(uchar *data) {
+	prog_address = (data[3] << 8) | data[2];
+	prog_blockflags = data[5] & 0x0F;
+	prog_nbytes = (data[7] << 8) | data[6];
+	progStart(PROG_STATE_TPI_WRITE);
+	return USB_NO_MSG; /* multiple out */
+}
+
+static usbMsgLen_t cmdTPIChecksum(uchar *data) {
+	unsigned int crc;
+
+	crc = tpiChecksum((data[3] << 8) | data[2], (data[5] << 8) | data[4]);
+	replyBuffer[0] = crc;
+	replyBuffer[1] = crc >> 8;
+	return 2;
+}
+
+static usbMsgLen_t cmdTPIVerifyBlock(uchar *data) {
+	prog_address = (data[3] << 8) | data[2];
+	prog_nbytes = (data[7] << 8) | data[6];
+	prog_state = PROG_STATE_TPI_VERIFY;
+	return USB_NO_MSG; /* multiple out */
+}
+
+static usbMsgLen_t cmdGetStatus(uchar *data) {
+	uchar n;
+
+	/* error count and failing addresses, cleared on read */
+	n = prog_errcount;
+	if (n > USBASP_STATUS_ERRORS)
+		n = USBASP_STATUS_ERRORS;
+	if (n == 0) {
+		/* keep the reply at least one address long */
+		prog_errlist[1] = prog_errlist[2] = prog_errlist[3] = prog_errlist[4] = 0;
+		n = 1;
+	}
+	prog_errlist[0] = prog_errcount;
+	prog_errcount = 0;
+	usbMsgPtr = prog_errlist;
+	return 1 + 4 * n;
+}
+
+static usbMsgLen_t cmdScriptLoad(uchar *data) {
+	uchar i;
+
+	prog_address = 0;
+	prog_nbytes = (data[7] << 8) | data[6];
+	if (prog_nbytes > SCRIPT_SIZE)
+		return 0;
+
+	/* unused space terminates script */
+	for (i = 0; i < SCRIPT_SIZE; i++) {
+		script_buf[i] = SCRIPT_OP_END;
+	}
+	prog_state = PROG_STATE_SCRIPT_LOAD;
+	return USB_NO_MSG; /* multiple out */
+}
+
+static usbMsgLen_t cmdScriptRun(uchar *data) {
+	usbMsgPtr = script_result;
+	return scriptRun(script_result);
+}
+
+static usbMsgLen_t cmdSession(uchar *data) {
+	uchar i;
+
+	/* CONNECT, ENABLEPROG and reading the device configuration at once,
+	   wValue low byte optionally selects SCK like SETISPSCK */
+	if (data[2] != USBASP_ISP_SCK_AUTO)
+		prog_sck = data[2];
+
+	cmdConnect(data);
+	replyBuffer[USBASP_SESSION_STATUS] = progEnable();
+	replyBuffer[USBASP_SESSION_RETRIES] = isp_retries;
+	replyBuffer[USBASP_SESSION_SCK] = isp_sck;
+	if (replyBuffer[USBASP_SESSION_STATUS] != 0)
+		return USBASP_SESSION_SCK + 1;
+
+	for (i = 0; i < 3; i++) {
+		replyBuffer[USBASP_SESSION_SIGNATURE + i]
+				= ispCommand(0x30, 0x00, i, 0x00);
+	}
+	replyBuffer[USBASP_SESSION_LFUSE] = ispCommand(0x50, 0x00, 0x00, 0x00);
+	replyBuffer[USBASP_SESSION_HFUSE] = ispCommand(0x58, 0x08, 0x00, 0x00);
+	replyBuffer[USBASP_SESSION_EFUSE] = ispCommand(0x50, 0x08, 0x00, 0x00);
+	replyBuffer[USBASP_SESSION_LOCK] = ispCommand(0x58, 0x00, 0x00, 0x00);
+	replyBuffer[USBASP_SESSION_CALIBRATION] = ispCommand(0x38, 0x00, 0x00, 0x00);
+	return USBASP_SESSION_LEN;
+}
+
+static usbMsgLen_t cmdSetSerial(uchar *data) {
+
+	/* new serial number follows in the data stage */
+	prog_address = 0;
+	prog_nbytes = (data[7] << 8) | data[6];
+	if ((prog_nbytes == 0) || (prog_nbytes > USBASP_SERIAL_MAX))
+		return 0;
+
+	prog_state = PROG_STATE_SETSERIAL;
+	return USB_NO_MSG; /* multiple out */
+}
+
+#if USB_CFG_IMPLEMENT_FN_WRITEOUT
+static usbMsgLen_t cmdStreamWrite(uchar *data) {
+
+	/* flash data follows on endpoint 1, length in wValue */
+	if (!prog_address_newmode)
+		prog_address = 0;
+
+	progSetPaging(data);
+	prog_nbytes = (data[3] << 8) | data[2];
+	replyBuffer[0] = progUpdateReject(1);
+	if (replyBuffer[0])
+		return 1;
+	progStart(PROG_STATE_WRITEFLASH);
+	prog_state = PROG_STATE_STREAMWRITE;
+	return 1;
+}
+#else
+#define cmdStreamWrite 0
+#endif
+
+#if USB_CFG_HAVE_INTRIN_ENDPOINT
+static usbMsgLen_t cmdStreamRead(uchar *data) {
+
+	/* data is sent on endpoint 1, length in wValue, memory in wIndex */
+	if (!prog_address_newmode)
+		prog_address = 0;
+
+	prog_nbytes = (data[3] << 8) | data[2];
+	progStart(data[4] ? PROG_STATE_READEEPROM : PROG_STATE_READFLASH);
+	prog_state = PROG_STATE_STREAMREAD;
+	replyBuffer[0] = 0;
+	return 1;
+}
+#else
+#define cmdStreamRead 0
+#endif
+
+#ifdef ISP_WITH_GANG
+static usbMsgLen_t cmdGangSelect(uchar *data) {
+
+	/* targets for next CONNECT in wValue low byte, see isp_gang */
+	isp_gang = data[2] & ISP_GANG_ALL;
+	replyBuffer[0] = isp_gang;
+	return 1;
+}
+#else
+#define cmdGangSelect 0
+#endif
+
+#ifdef ISP_WITH_STANDALONE
+static usbMsgLen_t cmdSFErase(uchar *data) {
+	replyBuffer[0] = sfErase(*((unsigned long*) &data[2]));
+	return 1;
+}
+
+static usbMsgLen_t cmdSFWrite(uchar *data) {
+	prog_address = *((unsigned long*) &data[2]);
+	prog_nbytes = (data[7] << 8) | data[6];
+	prog_state = PROG_STATE_SF_WRITE;
+	return USB_NO_MSG; /* multiple out */
+}
+
+static usbMsgLen_t cmdSFRead(uchar *data) {
+	prog_address = *((unsigned long*) &data[2]);
+	prog_nbytes = (data[7] << 8) | data[6];
+	prog_state = PROG_STATE_SF_READ;
+	return USB_NO_MSG; /* multiple in */
+}
+#else
+#define cmdSFErase 0
+#define cmdSFWrite 0
+#define cmdSFRead 0
+#endif
+
+/* command table, indexed by USBASP_FUNC_*, unused ids stay 0. caps0/caps1
+   are the USBASP_CAP_0_* and USBASP_CAP_1_* bits a command contributes to
+   GETCAPABILITIES */
+typedef usbMsgLen_t (*progHandler_t)(uchar *data);
+
+typedef struct {
+	progHandler_t handler;
+	uchar caps0;
+	uchar caps1;
+} progCommand_t;
+
+static const progCommand_t prog_commands[] PROGMEM = {
+	[USBASP_FUNC_CONNECT] = { cmdConnect, 0, 0 },
+	[USBASP_FUNC_DISCONNECT] = { cmdDisconnect, USBASP_CAP_0_HOLD, 0 },
+	[USBASP_FUNC_TRANSMIT] = { cmdTransmit, 0, 0 },
+	[USBASP_FUNC_READFLASH] = { cmdReadFlash, 0, 0 },
+	[USBASP_FUNC_ENABLEPROG] = { cmdEnableProg, 0, 0 },
+	[USBASP_FUNC_WRITEFLASH] = { cmdWriteFlash, 0, USBASP_CAP_1_UPDATE },
+	[USBASP_FUNC_READEEPROM] = { cmdReadEEPROM, 0, 0 },
+	[USBASP_FUNC_WRITEEEPROM] = { cmdWriteEEPROM, 0, 0 },
+	[USBASP_FUNC_SETLONGADDRESS] = { cmdSetLongAddress, 0, 0 },
+	[USBASP_FUNC_SETISPSCK] = { cmdSetISPSCK, 0, 0 },
+	[USBASP_FUNC_TPI_CONNECT] = { cmdTPIConnect, USBASP_CAP_0_TPI, 0 },
+	[USBASP_FUNC_TPI_DISCONNECT] = { cmdTPIDisconnect, 0, 0 },
+	[USBASP_FUNC_TPI_RAWREAD] = { cmdTPIRawRead, 0, 0 },
+	[USBASP_FUNC_TPI_RAWWRITE] = { cmdTPIRawWrite, 0, 0 },
+	[USBASP_FUNC_TPI_READBLOCK] = { cmdTPIReadBlock, 0, 0 },
+	[USBASP_FUNC_TPI_WRITEBLOCK] = { cmdTPIWriteBlock, 0, 0 },
+	[USBASP_FUNC_TPI_CHECKSUM] = { cmdTPIChecksum, 0, 0 },
+	[USBASP_FUNC_TPI_VERIFYBLOCK] = { cmdTPIVerifyBlock,
+			USBASP_CAP_0_TPI_VERIFY, 0 },
+	[USBASP_FUNC_GETSTATUS] = { cmdGetStatus, 0, 0 },
+	[USBASP_FUNC_SCRIPT_LOAD] = { cmdScriptLoad, 0, 0 },
+	[USBASP_FUNC_SCRIPT_RUN] = { cmdScriptRun, USBASP_CAP_0_SCRIPT, 0 },
+	[USBASP_FUNC_STREAMWRITE] = { cmdStreamWrite, USBASP_CAP_0_STREAMOUT, 0 },
+	[USBASP_FUNC_STREAMREAD] = { cmdStreamRead, USBASP_CAP_0_STREAMIN, 0 },
+	[USBASP_FUNC_SETSERIAL] = { cmdSetSerial, USBASP_CAP_0_SERIAL, 0 },
+	[USBASP_FUNC_SESSION] = { cmdSession, USBASP_CAP_0_SESSION, 0 },
+	[USBASP_FUNC_WRITEFLASH_RLE] = { cmdWriteFlashRLE, 0, USBASP_CAP_1_RLE },
+	[USBASP_FUNC_FILL] = { cmdFill, 0, USBASP_CAP_1_FILL },
+	[USBASP_FUNC_GANG_SELECT] = { cmdGangSelect, 0, USBASP_CAP_1_GANG },
+	[USBASP_FUNC_SF_ERASE] = { cmdSFErase, 0, USBASP_CAP_1_STANDALONE },
+	[USBASP_FUNC_SF_WRITE] = { cmdSFWrite, 0, 0 },
+	[USBASP_FUNC_SF_READ] = { cmdSFRead, 0, 0 },
+};
+
+#define PROG_COMMANDS (sizeof(prog_commands) / sizeof(prog_commands[0]))
+
+static progHandler_t progHandler(uchar cmd) {
+	return (progHandler_t) pgm_read_word(&prog_commands[cmd].handler);
+}
+
+static usbMsgLen_t cmdGetCapabilities(uchar *data) {
+	uchar i;
+
+	/* capability bits of all commands built into this firmware */
+	replyBuffer[0] = 0;
+	replyBuffer[1] = 0;
+	for (i = 0; i < PROG_COMMANDS; i++) {
+		if (progHandler(i)) {
+			replyBuffer[0] |= pgm_read_byte(&prog_commands[i].caps0);
+			replyBuffer[1] |= pgm_read_byte(&prog_commands[i].caps1);
+		}
 	}
+	replyBuffer[2] = 0;
+	replyBuffer[3] = 0;
+
+	/* limits, see USBASP_CAPS_* in usbasp.h */
+	replyBuffer[USBASP_CAPS_SCK_MAX] = USBASP_ISP_SCK_1500;
+	replyBuffer[USBASP_CAPS_BUFSIZE] = PROG_BUF_SIZE;
+#if USB_CFG_LONG_TRANSFERS
+	replyBuffer[USBASP_CAPS_MAXLEN] = 0xff;
+	replyBuffer[USBASP_CAPS_MAXLEN + 1] = 0xff;
+#else
+	replyBuffer[USBASP_CAPS_MAXLEN] = 254;
+	replyBuffer[USBASP_CAPS_MAXLEN + 1] = 0;
+#endif
+	replyBuffer[USBASP_CAPS_CLOCK] = F_CPU / 1000000L;
+	replyBuffer[USBASP_CAPS_SCRIPT] = SCRIPT_SIZE;
+	return USBASP_CAPS_LEN;
+}
+
+usbMsgLen_t usbFunctionSetup(uchar data[8]) {
+
+	progHandler_t handler;
 
 	usbMsgPtr = replyBuffer;
 
-	return len;
+	/* doesn't touch the target, answer without waiting for it */
+	if (data[1] == USBASP_FUNC_GETCAPABILITIES)
+		return cmdGetCapabilities(data);
+
+	/* a fill runs on after its request, an EEPROM fill for seconds.
+	   Ignore requests meanwhile instead of waiting for it in progFlush */
+	if ((job_state != PROG_STATE_IDLE) && (job_source == PROG_SOURCE_FILL))
+		return 0;
+
+	/* finish pending writes before next request */
+	progFlush();
+
+	if (data[1] >= PROG_COMMANDS)
+		return 0;
+
+	handler = progHandler(data[1]);
+	if (!handler)
+		return 0;
+
+	return handler(data);
 }
 
 uchar usbFunctionRead(uchar *data, uchar len) {
 
 	uchar i;
 
+#ifdef ISP_WITH_STANDALONE
+	if (prog_state == PROG_STATE_SF_READ) {
+		if (len > prog_nbytes)
+			len = prog_nbytes;
+		sfRead(prog_address, data, len);
+		prog_address += len;
+		prog_nbytes -= len;
+		if (prog_nbytes == 0) {
+			prog_state = PROG_STATE_IDLE;
+		}
+		return len;
+	}
+#endif
+
 	/* check if programmer is in correct read state */
 	if ((prog_state != PROG_STATE_READFLASH) && (prog_state
 			!= PROG_STATE_READEEPROM) && (prog_state != PROG_STATE_TPI_READ)) {
 		return 0xff;
 	}
 
-	/* fill packet TPI mode */
-	if(prog_state == PROG_STATE_TPI_READ)
-	{
-		tpi_read_block(prog_address, data, len);
-		prog_address += len;
-		return len;
-	}
+	if (len > prog_nbytes)
+		len = prog_nbytes;
 
-	/* fill packet ISP mode */
+	/* fill packet with data prefetched by progPoll */
+	while (prog_buf_cnt < len) {
+		progPoll();
+	}
 	for (i = 0; i < len; i++) {
-		if (prog_state == PROG_STATE_READFLASH) {
-			data[i] = ispReadFlash(prog_address);
-		} else {
-			data[i] = ispReadEEPROM(prog_address);
-		}
-		prog_address++;
+		data[i] = progBufGet();
 	}
 
+	prog_address += len;
+	prog_nbytes -= len;
+
 	/* last packet? */
-	if (len < 8) {
+	if (prog_nbytes == 0) {
 		prog_state = PROG_STATE_IDLE;
 	}
 
@@ -235,90 +1320,147 @@ uchar usbFunctionRead(uchar *data, uchar len) {
 
 uchar usbFunctionWrite(uchar *data, uchar len) {
 
-	uchar retVal = 0;
 	uchar i;
 
+#ifdef ISP_WITH_STANDALONE
+	if (prog_state == PROG_STATE_SF_WRITE) {
+		if (sfWrite(prog_address, data, len) == 0) {
+			prog_address += len;
+			prog_nbytes -= len;
+			if (prog_nbytes != 0)
+				return 0;
+		}
+		prog_state = PROG_STATE_IDLE;
+		return 1;
+	}
+#endif
+
 	/* check if programmer is in correct write state */
 	if ((prog_state != PROG_STATE_WRITEFLASH) && (prog_state
-			!= PROG_STATE_WRITEEEPROM) && (prog_state != PROG_STATE_TPI_WRITE)) {
+			!= PROG_STATE_WRITEEEPROM) && (prog_state != PROG_STATE_TPI_WRITE)
+			&& (prog_state != PROG_STATE_TPI_VERIFY)
+			&& (prog_state != PROG_STATE_SCRIPT_LOAD)
+			&& (prog_state != PROG_STATE_SETSERIAL)
+			&& (prog_state != PROG_STATE_FILL)) {
 		return 0xff;
 	}
 
-	if (prog_state == PROG_STATE_TPI_WRITE)
-	{
-		tpi_write_block(prog_address, data, len);
-		prog_address += len;
+	if (prog_state == PROG_STATE_FILL) {
+		for (i = 0; i < len; i++) {
+			fill_pattern[fill_len++] = data[i];
+		}
+		prog_nbytes -= len;
+		if (prog_nbytes != 0)
+			return 0;
+
+		/* pattern complete, start the fill job */
+		fill_len--;
+		prog_nbytes = fill_nbytes;
+		if (fill_pattern[0]) {
+			prog_pagesize = 0;
+			prog_blockflags = 0;
+			progStart(PROG_STATE_WRITEEEPROM);
+		} else {
+			progStart(PROG_STATE_WRITEFLASH);
+		}
+		job_source = PROG_SOURCE_FILL;
+		fill_index = 0;
+		prog_address += fill_nbytes;
+		prog_state = PROG_STATE_IDLE;
+		return 1;
+	}
+
+	if (prog_state == PROG_STATE_SETSERIAL) {
+		for (i = 0; i < len; i++) {
+			eeprom_write_byte((uchar *) EEPROM_SERIAL + 1 + prog_address++,
+					data[i]);
+		}
 		prog_nbytes -= len;
-		if(prog_nbytes <= 0)
-		{
+		if (prog_nbytes == 0) {
+			/* store length, new serial is reported after re-enumeration */
+			eeprom_write_byte((uchar *) EEPROM_SERIAL, prog_address);
+			serialLoad();
 			prog_state = PROG_STATE_IDLE;
 			return 1;
 		}
 		return 0;
 	}
 
-	for (i = 0; i < len; i++) {
+	if (prog_state == PROG_STATE_SCRIPT_LOAD) {
+		for (i = 0; i < len; i++) {
+			script_buf[prog_address++] = data[i];
+		}
+		prog_nbytes -= len;
+		if (prog_nbytes == 0) {
+			prog_state = PROG_STATE_IDLE;
+			return 1;
+		}
+		return 0;
+	}
 
-		if (prog_state == PROG_STATE_WRITEFLASH) {
-			/* Flash */
+	if (prog_state == PROG_STATE_TPI_VERIFY) {
+		uchar buf[8];
 
-			if (prog_pagesize == 0) {
-				/* not paged */
-				ispWriteFlash(prog_address, data[i], 1);
-			} else {
-				/* paged */
-				ispWriteFlash(prog_address, data[i], 0);
-				prog_pagecounter--;
-				if (prog_pagecounter == 0) {
-					ispFlushPage(prog_address, data[i]);
-					prog_pagecounter = prog_pagesize;
-				}
+		/* compare uploaded data with target memory */
+		tpi_read_block(prog_address, buf, len);
+		for (i = 0; i < len; i++) {
+			if (buf[i] != data[i]) {
+				progError(prog_address + i);
 			}
-
-		} else {
-			/* EEPROM */
-			ispWriteEEPROM(prog_address, data[i]);
 		}
-
-		prog_nbytes--;
-
+		prog_address += len;
+		prog_nbytes -= len;
 		if (prog_nbytes == 0) {
 			prog_state = PROG_STATE_IDLE;
-			if ((prog_blockflags & PROG_BLOCKFLAG_LAST) && (prog_pagecounter
-					!= prog_pagesize)) {
+			return 1;
+		}
+		return 0;
+	}
 
-				/* last block and page flush pending, so flush it now */
-				ispFlushPage(prog_address, data[i]);
-			}
+	return progQueue(data, len);
+}
 
-			retVal = 1; // Need to return 1 when no more data is to be received
-		}
+#if USB_CFG_IMPLEMENT_FN_WRITEOUT
+void usbFunctionWriteOut(uchar *data, uchar len) {
 
-		prog_address++;
+	/* flash data stream on interrupt-out endpoint 1 */
+	if ((prog_state != PROG_STATE_STREAMWRITE) || (len > prog_nbytes)) {
+		return;
 	}
 
-	return retVal;
+	progQueue(data, len);
 }
+#endif
 
 int main(void) {
-	uchar i, j;
 
 	/* no pullups on USB and ISP pins */
 	PORTD = 0;
 	PORTB = 0;
 	/* all outputs except PD2 = INT0 */
 	DDRD = ~(1 << 2);
+#ifdef ISP_WITH_GANG
+	/* gang reset lines released until CONNECT */
+	DDRD &= ~ISP_GANG_MASK;
+#endif
+#ifdef ISP_WITH_STANDALONE
+	sfInit();
+#endif
 
-	/* output SE0 for USB reset */
-	DDRB = ~0;
-	j = 0;
-	/* USB Reset by device only required on Watchdog Reset */
-	while (--j) {
-		i = 0;
-		/* delay >10ms for USB reset */
-		while (--i)
-			;
+	/* init timer */
+	clockInit();
+
+	/* USB Reset by device, skipped only after power-on (PORF): the host
+	   saw the detach then. After any other reset (watchdog, brown-out,
+	   external, jump from a bootloader) it may still hold a stale device */
+	if (!(MCUCSR & (1 << PORF))) {
+		/* output SE0 for USB reset */
+		DDRB = ~0;
+		/* delay >10ms for USB reset: 40 * 320us at any F_CPU */
+		clockWait(40);
 	}
+	MCUCSR = 0;
+
 	/* all USB and ISP pins inputs */
 	DDRB = 0;
 
@@ -326,14 +1468,21 @@ int main(void) {
 	DDRC = 0x03;
 	PORTC = 0xfe;
 
-	/* init timer */
-	clockInit();
+	serialLoad();
 
 	/* main event loop */
 	usbInit();
 	sei();
 	for (;;) {
 		usbPoll();
+		progPoll();
+		progHoldPoll();
+#ifdef ISP_WITH_STANDALONE
+		standalonePoll();
+#endif
+#if USB_CFG_HAVE_INTRIN_ENDPOINT
+		progStreamPoll();
+#endif
 	}
 	return 0;
 }
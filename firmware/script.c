@@ -0,0 +1,127 @@
+/*
+ * script.c - part of USBasp
+ *
+ * Description....: Interpreter for batched ISP command scripts
+ * Licence........: GNU GPL v2 (see Readme.txt)
+ * Creation Date..: 2026-10-16
+ * Last change....: 2026-10-16
+ */
+
+#include <avr/io.h>
+#include "script.h"
+#include "isp.h"
+#include "clock.h"
+
+uchar script_buf[SCRIPT_SIZE];
+
+/* run time is measured with timer 1 at F_CPU/1024 */
+#define SCRIPT_MAX_TICKS   ((unsigned int) (F_CPU / 1024 * SCRIPT_MAX_TIME / 1000))
+
+/* timer 1 ticks of WAIT time * 320us */
+#define scriptWaitTicks(time) \
+	((unsigned int) (((unsigned long) (time) * (F_CPU / 100000)) / 32))
+
+uchar scriptRun(uchar *result) {
+
+	uchar pc = 0;
+	uchar len = 1;
+	uchar last = 0;
+	uchar flag = 0;
+	uchar jumps = SCRIPT_MAX_JUMPS;
+	uchar status = SCRIPT_ERR_OPCODE;
+	uchar *op;
+
+	TCNT1 = 0;
+	TCCR1B = (1 << CS12) | (1 << CS10);
+
+	while (pc < SCRIPT_SIZE) {
+		op = &script_buf[pc];
+
+		if (TCNT1 >= SCRIPT_MAX_TICKS) {
+			status = SCRIPT_ERR_TIME;
+			break;
+		}
+
+		if (op[0] == SCRIPT_OP_END) {
+			status = SCRIPT_OK;
+			break;
+
+		} else if ((op[0] == SCRIPT_OP_SPI) || (op[0] == SCRIPT_OP_SPI_READ)) {
+			if (pc + 5 > SCRIPT_SIZE)
+				break;
+			last = ispCommand(op[1], op[2], op[3], op[4]);
+			if (op[0] == SCRIPT_OP_SPI_READ) {
+				if (len == SCRIPT_RESULT_SIZE) {
+					status = SCRIPT_ERR_RESULT;
+					break;
+				}
+				result[len++] = last;
+			}
+			pc += 5;
+
+		} else if (pc + 2 > SCRIPT_SIZE) {
+			/* all other opcodes take at least one operand */
+			break;
+
+		} else if (op[0] == SCRIPT_OP_WAIT) {
+			if (TCNT1 + scriptWaitTicks(op[1]) > SCRIPT_MAX_TICKS) {
+				status = SCRIPT_ERR_TIME;
+				break;
+			}
+			clockWait(op[1]);
+			pc += 2;
+
+		} else if (op[0] == SCRIPT_OP_POLL) {
+			uchar retries;
+			uint8_t starttime;
+
+			if (pc + 8 > SCRIPT_SIZE)
+				break;
+			retries = op[7];
+			starttime = TIMERVALUE;
+			flag = 1;
+			for (;;) {
+				last = ispCommand(op[1], op[2], op[3], op[4]);
+				if ((last & op[5]) == op[6]) {
+					flag = 0;
+					break;
+				}
+				if (TCNT1 >= SCRIPT_MAX_TICKS)
+					break;
+				if ((uint8_t) (TIMERVALUE - starttime) > CLOCK_T_320us) {
+					starttime = TIMERVALUE;
+					if (retries-- == 0)
+						break;
+				}
+			}
+			if (flag && (TCNT1 >= SCRIPT_MAX_TICKS)) {
+				status = SCRIPT_ERR_TIME;
+				break;
+			}
+			pc += 8;
+
+		} else if (op[0] == SCRIPT_OP_CMP) {
+			flag = (last != op[1]);
+			pc += 2;
+
+		} else if (op[0] == SCRIPT_OP_JNE) {
+			if (flag) {
+				if (jumps-- == 0) {
+					status = SCRIPT_ERR_LOOP;
+					break;
+				}
+				pc = op[1];
+			} else {
+				pc += 2;
+			}
+
+		} else {
+			break;
+		}
+	}
+
+	TCCR1B = 0;
+
+	result[0] = status;
+	return len;
+}
@@ -0,0 +1,53 @@
+/*
+ * script.h - part of USBasp
+ *
+ * Description....: Interpreter for batched ISP command scripts
+ * Licence........: GNU GPL v2 (see Readme.txt)
+ * Creation Date..: 2026-10-16
+ * Last change....: 2026-10-16
+ */
+
+#ifndef __script_h_included__
+#define	__script_h_included__
+
+#include "usbasp.h"
+
+#ifndef uchar
+#define	uchar	unsigned char
+#endif
+
+/* max script length, max 255: 48, 96 or 192 bytes */
+#define SCRIPT_SIZE        (48 << USBASP_RAM_SCALE)
+#define SCRIPT_RESULT_SIZE 16  /* status byte + collected answers */
+
+/* opcodes, operands follow in the script */
+#define SCRIPT_OP_END      0   /* stop */
+#define SCRIPT_OP_SPI      1   /* 4 bytes: transmit, keep last answer */
+#define SCRIPT_OP_SPI_READ 2   /* 4 bytes: transmit, append last answer */
+#define SCRIPT_OP_WAIT     3   /* time: wait time * 320us */
+#define SCRIPT_OP_POLL     4   /* 4 bytes, mask, value, time: transmit until
+                                  answer & mask == value, clear flag on match */
+#define SCRIPT_OP_CMP      5   /* value: set flag if last answer differs */
+#define SCRIPT_OP_JNE      6   /* offset: jump to offset if flag is set */
+
+/* status, first byte of result */
+#define SCRIPT_OK          0
+#define SCRIPT_ERR_OPCODE  1   /* unknown opcode or end of buffer */
+#define SCRIPT_ERR_RESULT  2   /* result buffer full */
+#define SCRIPT_ERR_LOOP    3   /* too many jumps taken */
+#define SCRIPT_ERR_TIME    4   /* run time used up */
+
+/* max number of jumps taken in one run */
+#define SCRIPT_MAX_JUMPS   255
+
+/* max run time in ms, all instructions count. The script runs inside
+   the USB request, keep it well below host timeouts */
+#define SCRIPT_MAX_TIME    500
+
+/* script, loaded by host */
+extern uchar script_buf[SCRIPT_SIZE];
+
+/* run script, fill result with status and answers, return result length */
+uchar scriptRun(uchar *result);
+
+#endif /* __script_h_included__ */
@@ -0,0 +1,241 @@
+/*
+ * standalone.c - part of USBasp
+ *
+ * Description....: PC-less programming from an image in external SPI flash
+ * Licence........: GNU GPL v2 (see Readme.txt)
+ * Creation Date..: 2026-10-16
+ * Last change....: 2026-10-16
+ */
+
+#include <avr/io.h>
+#include "usbasp.h"
+#include "standalone.h"
+#include "isp.h"
+#include "clock.h"
+
+#ifdef ISP_WITH_STANDALONE
+
+#define sfSelect()   SF_OUT &= ~(1 << SF_CS)
+#define sfDeselect() SF_OUT |= (1 << SF_CS)
+
+/* SPI flash busy timeout, 320us ticks */
+#define SF_TIMEOUT   3125 /* 1 s */
+
+/* button must be released this long before next start, 320us ticks */
+#define SA_DEBOUNCE  63
+
+static uchar sa_idle;
+static uint8_t sa_time;
+
+static uchar sfTransmit(uchar send_byte) {
+	uchar i;
+
+	for (i = 0; i < 8; i++) {
+		if (send_byte & 0x80) {
+			SF_OUT |= (1 << SF_MOSI);
+		} else {
+			SF_OUT &= ~(1 << SF_MOSI);
+		}
+		send_byte <<= 1;
+
+		SF_OUT |= (1 << SF_SCK);
+		if (SF_IN & (1 << SF_MISO)) {
+			send_byte |= 1;
+		}
+		SF_OUT &= ~(1 << SF_SCK);
+	}
+
+	return send_byte;
+}
+
+/* select chip and send instruction with 24 bit address */
+static void sfCommand(uchar cmd, unsigned long address) {
+	sfSelect();
+	sfTransmit(cmd);
+	sfTransmit(address >> 16);
+	sfTransmit(address >> 8);
+	sfTransmit(address);
+}
+
+static void sfWriteEnable() {
+	sfSelect();
+	sfTransmit(SF_CMD_WREN);
+	sfDeselect();
+}
+
+static uchar sfWaitReady() {
+	unsigned int ticks = SF_TIMEOUT;
+	uint8_t start = TIMERVALUE;
+	uchar status;
+
+	sfSelect();
+	sfTransmit(SF_CMD_STATUS);
+	do {
+		status = sfTransmit(0);
+		if ((uint8_t) (TIMERVALUE - start) >= CLOCK_T_320us) {
+			start = TIMERVALUE;
+			ticks--;
+		}
+	} while ((status & SF_STATUS_BUSY) && ticks);
+	sfDeselect();
+
+	return (status & SF_STATUS_BUSY) ? 1 : 0;
+}
+
+void sfInit() {
+	SF_DDR |= (1 << SF_CS) | (1 << SF_SCK) | (1 << SF_MOSI);
+	SF_DDR &= ~((1 << SF_MISO) | (1 << SA_START));
+	SF_OUT &= ~(1 << SF_SCK);
+	/* deselect flash, pullup on start button */
+	SF_OUT |= (1 << SF_CS) | (1 << SA_START);
+}
+
+void sfRead(unsigned long address, uchar *buf, uchar len) {
+	sfCommand(SF_CMD_READ, address);
+	while (len--) {
+		*buf++ = sfTransmit(0);
+	}
+	sfDeselect();
+}
+
+uchar sfWrite(unsigned long address, uchar *buf, uchar len) {
+	unsigned int n;
+
+	while (len) {
+		/* page program must not cross a page boundary */
+		n = SF_PAGE_SIZE - (address & (SF_PAGE_SIZE - 1));
+		if (n > len)
+			n = len;
+
+		sfWriteEnable();
+		sfCommand(SF_CMD_PROGRAM, address);
+		address += n;
+		len -= n;
+		while (n--) {
+			sfTransmit(*buf++);
+		}
+		sfDeselect();
+
+		if (sfWaitReady())
+			return 1;
+	}
+
+	return 0;
+}
+
+uchar sfErase(unsigned long address) {
+	sfWriteEnable();
+	sfCommand(SF_CMD_ERASE_4K, address);
+	sfDeselect();
+	return sfWaitReady();
+}
+
+uchar standaloneRun() {
+	uchar hdr[USBASP_SA_HDR_SIZE];
+	unsigned long address, flashlen;
+	unsigned int pagesize, counter, eepromlen;
+	uchar i, data;
+
+	sfRead(0, hdr, USBASP_SA_HDR_SIZE);
+	if ((hdr[USBASP_SA_HDR_MAGIC] != USBASP_SA_MAGIC0)
+			|| (hdr[USBASP_SA_HDR_MAGIC + 1] != USBASP_SA_MAGIC1))
+		return USBASP_SA_ERR_IMAGE;
+
+	pagesize = hdr[USBASP_SA_HDR_PAGESIZE]
+			| (hdr[USBASP_SA_HDR_PAGESIZE + 1] << 8);
+	flashlen = *((unsigned long *) &hdr[USBASP_SA_HDR_FLASHLEN]);
+	eepromlen = hdr[USBASP_SA_HDR_EEPROMLEN]
+			| (hdr[USBASP_SA_HDR_EEPROMLEN + 1] << 8);
+
+	ispSetSCKOption(hdr[USBASP_SA_HDR_SCK]);
+	ispConnect();
+	if (ispEnterProgrammingMode())
+		return USBASP_SA_ERR_CONNECT;
+
+	for (i = 0; i < 3; i++) {
+		if (ispCommand(0x30, 0x00, i, 0x00)
+				!= hdr[USBASP_SA_HDR_SIGNATURE + i])
+			return USBASP_SA_ERR_SIGNATURE;
+	}
+
+	/* chip erase */
+	ispCommand(0xAC, 0x80, 0x00, 0x00);
+	clockWait(60);
+
+	/* flash, read from SPI flash while programming */
+	sfCommand(SF_CMD_READ, USBASP_SA_HDR_SIZE);
+	counter = pagesize;
+	for (address = 0; address < flashlen; address++) {
+		data = sfTransmit(0);
+		if (pagesize == 0) {
+			ispWriteFlash(address, data, 1);
+		} else {
+			ispWriteFlash(address, data, 0);
+			if ((--counter != 0) && (address != flashlen - 1))
+				continue;
+			ispFlushPage(address, data);
+			counter = pagesize;
+		}
+		if (ispWait() == ISP_FAILED) {
+			sfDeselect();
+			return USBASP_SA_ERR_WRITE;
+		}
+	}
+	sfDeselect();
+
+	/* verify flash, then EEPROM data follows in SPI flash */
+	sfCommand(SF_CMD_READ, USBASP_SA_HDR_SIZE);
+	for (address = 0; address < flashlen; address++) {
+		if (ispReadFlash(address) != sfTransmit(0)) {
+			sfDeselect();
+			return USBASP_SA_ERR_VERIFY;
+		}
+	}
+
+	for (address = 0; address < eepromlen; address++) {
+		data = sfTransmit(0);
+		ispWriteEEPROM(address, data);
+		if ((ispWait() == ISP_FAILED) || (ispReadEEPROM(address) != data)) {
+			sfDeselect();
+			return USBASP_SA_ERR_VERIFY;
+		}
+	}
+	sfDeselect();
+
+	return USBASP_SA_OK;
+}
+
+void standalonePoll() {
+
+	if (SF_IN & (1 << SA_START)) {
+		/* released, count debounce time */
+		if ((uint8_t) (TIMERVALUE - sa_time) >= CLOCK_T_320us) {
+			sa_time = TIMERVALUE;
+			if (sa_idle < SA_DEBOUNCE)
+				sa_idle++;
+		}
+		return;
+	}
+
+	if (sa_idle < SA_DEBOUNCE) {
+		sa_idle = 0;
+		return;
+	}
+	sa_idle = 0;
+
+	/* busy: red on, green off */
+	ledGreenOff();
+	ledRedOn();
+
+	if (standaloneRun() == USBASP_SA_OK) {
+		ledRedOff();
+		ledGreenOn();
+	} else {
+		ledGreenOff();
+		ledRedOn();
+	}
+
+	ispDisconnect();
+}
+
+#endif /* ISP_WITH_STANDALONE */
@@ -0,0 +1,62 @@
+/*
+ * standalone.h - part of USBasp
+ *
+ * Description....: PC-less programming from an image in external SPI flash
+ * Licence........: GNU GPL v2 (see Readme.txt)
+ * Creation Date..: 2026-10-16
+ * Last change....: 2026-10-16
+ */
+
+#ifndef __standalone_h_included__
+#define	__standalone_h_included__
+
+#ifndef uchar
+#define	uchar	unsigned char
+#endif
+
+#if defined(ISP_WITH_STANDALONE) && defined(ISP_WITH_GANG)
+#error "ISP_WITH_STANDALONE and ISP_WITH_GANG both use PD3..PD7"
+#endif
+
+/* 25 series SPI flash on PORTD, software SPI mode 0 */
+#define SF_OUT    PORTD
+#define SF_IN     PIND
+#define SF_DDR    DDRD
+#define SF_CS     PD3
+#define SF_SCK    PD4
+#define SF_MOSI   PD5
+#define SF_MISO   PD6
+
+/* start button to GND */
+#define SA_START  PD7
+
+/* SPI flash instructions */
+#define SF_CMD_WREN     0x06
+#define SF_CMD_STATUS   0x05
+#define SF_CMD_READ     0x03
+#define SF_CMD_PROGRAM  0x02
+#define SF_CMD_ERASE_4K 0x20
+
+#define SF_STATUS_BUSY  0x01
+#define SF_PAGE_SIZE    256
+
+/* init SPI flash and start button pins */
+void sfInit();
+
+/* read len bytes from SPI flash */
+void sfRead(unsigned long address, uchar *buf, uchar len);
+
+/* program len bytes to erased SPI flash, 0 if done, 1 on timeout */
+uchar sfWrite(unsigned long address, uchar *buf, uchar len);
+
+/* erase 4 KB sector containing address, 0 if done, 1 on timeout */
+uchar sfErase(unsigned long address);
+
+/* program target from image in SPI flash, return USBASP_SA_* result.
+   Target is left connected */
+uchar standaloneRun();
+
+/* start standaloneRun on button press and show result, call from main loop */
+void standalonePoll();
+
+#endif /* __standalone_h_included__ */
@@ -11,6 +11,8 @@
 /* Globals */
 /** Number of iterations in tpi_delay loop */
 extern uint16_t tpi_dly_cnt;
+/** Nonzero if cached PR matches PR of target, cleared by tpi_init */
+extern uint8_t tpi_pr_valid;
 
 
 /* Functions */
@@ -42,6 +44,22 @@ void tpi_read_block(uint16_t addr, uint8_t* dptr, uint8_t len);
  * \param len Length of write
  */
 void tpi_write_block(uint16_t addr, const uint8_t* sptr, uint8_t len);
+/**
+ * Set PR, skipped if PR already holds the address
+ * \param addr Address to set
+ * \param len Number of bytes that will be accessed with PR+
+ */
+void tpi_pr_update(uint16_t addr, uint8_t len);
+/**
+ * Start NVM write of one byte at PR+, does not wait for completion
+ * \param b Byte to write
+ */
+void tpi_write_byte(uint8_t b);
+/**
+ * Check NVM busy flag
+ * \return Nonzero while NVM is busy
+ */
+uint8_t tpi_nvm_busy(void);
 
 
 #endif /*__TPI_H__*/
@@ -52,6 +52,9 @@
 #define NVMCMD_SECTION_ERASE 0x14
 #define NVMCMD_WORD_WRITE    0x1D
 
+/* NVM memory map */
+#define TPI_SIGNATURE        0x3FC0
+
 
 
 
@@ -11,6 +11,17 @@
 #ifndef USBASP_H_
 #define USBASP_H_
 
+/* buffer scale of the target MCU by SRAM size: 0 for 512 bytes (atmega48),
+   1 for 1 KB (atmega8, atmega88), 2 for 2 KB. Buffers double per step,
+   the link checks that they fit (RAMSIZE and STACK in Makefile) */
+#if RAMEND >= 0x8FF
+#define USBASP_RAM_SCALE 2
+#elif RAMEND >= 0x45F
+#define USBASP_RAM_SCALE 1
+#else
+#define USBASP_RAM_SCALE 0
+#endif
+
 /* USB function call identifiers */
 #define USBASP_FUNC_CONNECT     1
 #define USBASP_FUNC_DISCONNECT  2
@@ -28,10 +39,45 @@
 #define USBASP_FUNC_TPI_RAWWRITE     14
 #define USBASP_FUNC_TPI_READBLOCK    15
 #define USBASP_FUNC_TPI_WRITEBLOCK   16
+#define USBASP_FUNC_TPI_CHECKSUM     17
+#define USBASP_FUNC_TPI_VERIFYBLOCK  18
+#define USBASP_FUNC_GETSTATUS        19
+#define USBASP_FUNC_SCRIPT_LOAD      20
+#define USBASP_FUNC_SCRIPT_RUN       21
+#define USBASP_FUNC_STREAMWRITE      22
+#define USBASP_FUNC_STREAMREAD       23
+#define USBASP_FUNC_SETSERIAL        24
+#define USBASP_FUNC_SESSION          25
+#define USBASP_FUNC_WRITEFLASH_RLE   26
+#define USBASP_FUNC_FILL             27
+#define USBASP_FUNC_GANG_SELECT      28
+#define USBASP_FUNC_SF_ERASE         29
+#define USBASP_FUNC_SF_WRITE         30
+#define USBASP_FUNC_SF_READ          31
 #define USBASP_FUNC_GETCAPABILITIES 127
 
 /* USBASP capabilities */
 #define USBASP_CAP_0_TPI    0x01
+#define USBASP_CAP_0_TPI_VERIFY 0x02
+#define USBASP_CAP_0_SCRIPT     0x04
+#define USBASP_CAP_0_STREAMOUT  0x08
+#define USBASP_CAP_0_STREAMIN   0x10
+#define USBASP_CAP_0_SERIAL     0x20
+#define USBASP_CAP_0_SESSION    0x40
+#define USBASP_CAP_0_HOLD       0x80
+#define USBASP_CAP_1_RLE        0x01
+#define USBASP_CAP_1_FILL       0x02
+#define USBASP_CAP_1_UPDATE     0x04
+#define USBASP_CAP_1_GANG       0x08
+#define USBASP_CAP_1_STANDALONE 0x10
+
+/* GETCAPABILITIES reply offsets after the capability bytes 0..3 */
+#define USBASP_CAPS_SCK_MAX  4 /* highest supported USBASP_ISP_SCK_* */
+#define USBASP_CAPS_BUFSIZE  5 /* engine buffer size in bytes */
+#define USBASP_CAPS_MAXLEN   6 /* max. bytes per read/write request (2 bytes LE) */
+#define USBASP_CAPS_CLOCK    8 /* F_CPU in MHz */
+#define USBASP_CAPS_SCRIPT   9 /* max. script length in bytes */
+#define USBASP_CAPS_LEN      10
 
 /* programming state */
 #define PROG_STATE_IDLE         0
@@ -41,10 +87,90 @@
 #define PROG_STATE_WRITEEEPROM  4
 #define PROG_STATE_TPI_READ     5
 #define PROG_STATE_TPI_WRITE    6
+#define PROG_STATE_TPI_VERIFY   7
+#define PROG_STATE_SCRIPT_LOAD  8
+#define PROG_STATE_STREAMWRITE  9
+#define PROG_STATE_STREAMREAD   10
+#define PROG_STATE_SETSERIAL    11
+#define PROG_STATE_FILL         12
+#define PROG_STATE_SF_WRITE     13
+#define PROG_STATE_SF_READ      14
 
 /* Block mode flags */
 #define PROG_BLOCKFLAG_FIRST    1
 #define PROG_BLOCKFLAG_LAST     2
+#define PROG_BLOCKFLAG_SPARSE   4   /* TPI: skip erased (0xFFFF) words */
+#define PROG_BLOCKFLAG_UPDATE   8   /* paged flash: no erase before, only clear bits */
+
+/* Update mode: plain WRITEFLASH or STREAMWRITE blocks only, page aligned,
+   whole pages except in the LAST block, page size up to USBASP_CAPS_BUFSIZE.
+   Each page is compared with flash before it is loaded, a page needing a
+   bit set is not written and nothing more is until the next FIRST block.
+   Pages before it stay written. Rejected blocks and failing pages go to
+   the GETSTATUS error list */
+
+/* GETSTATUS: error count, then up to this many failing addresses (4 bytes
+   LE each). Flash write failures report the address of the byte that
+   started the write, i.e. the last byte of the page */
+#define USBASP_STATUS_ERRORS      8
+
+/* WRITEFLASH_RLE coding: control byte n < 0x80 is followed by n + 1
+   literal bytes, n >= 0x80 by one byte repeated (n & 0x7F) + 2 times */
+#define USBASP_RLE_REPEAT         0x80
+
+/* FILL data stage: memory (0 = flash, 1 = EEPROM), then 1 to
+   USBASP_FILL_MAX pattern bytes. While the fill is still running all
+   requests except GETCAPABILITIES are ignored and return no data, poll
+   GETSTATUS until it answers */
+#define USBASP_FILL_MAX           4
+
+/* TPI_CONNECT delay: auto selects the delay cached for the last TPI
+   target, or the default if there is none. Other counts are taken as
+   meant for 12MHz and scaled to F_CPU, except the fast path */
+#define USBASP_TPI_DLY_AUTO       0xFFFF
+#define USBASP_TPI_DLY_FAST       0      /* unrolled, TPI clock F_CPU/12 */
+#define USBASP_TPI_DLY_DEFAULT    1
+
+/* GANG_SELECT: targets for next CONNECT in wValue low byte. With more
+   than one selected they all answer on MISO at once: ENABLEPROG success
+   and read data don't confirm every target, and the SCK cache and write
+   time lookup are not used. Verify each target selected alone */
+
+/* standalone image in SPI flash: header at address 0, flash data
+   follows, then EEPROM data. SF_* requests take the SPI flash address
+   in wValue/wIndex (4 bytes LE) */
+#define USBASP_SA_MAGIC0          'U'
+#define USBASP_SA_MAGIC1          'A'
+#define USBASP_SA_HDR_MAGIC       0  /* 2 bytes */
+#define USBASP_SA_HDR_SIGNATURE   2  /* 3 bytes */
+#define USBASP_SA_HDR_SCK         5  /* USBASP_ISP_SCK_* */
+#define USBASP_SA_HDR_PAGESIZE    6  /* flash page size, 2 bytes LE, 0 = not paged */
+#define USBASP_SA_HDR_FLASHLEN    8  /* 4 bytes LE */
+#define USBASP_SA_HDR_EEPROMLEN   12 /* 2 bytes LE */
+#define USBASP_SA_HDR_SIZE        16
+
+/* standalone results */
+#define USBASP_SA_OK              0
+#define USBASP_SA_ERR_IMAGE       1  /* no valid header */
+#define USBASP_SA_ERR_CONNECT     2  /* target doesn't answer */
+#define USBASP_SA_ERR_SIGNATURE   3  /* image is for other device */
+#define USBASP_SA_ERR_WRITE       4  /* write timeout */
+#define USBASP_SA_ERR_VERIFY      5
+
+/* SESSION reply offsets */
+#define USBASP_SESSION_STATUS     0  /* 0 = programming mode entered */
+#define USBASP_SESSION_RETRIES    1  /* failed programming enable attempts */
+#define USBASP_SESSION_SCK        2  /* USBASP_ISP_SCK_* in use */
+#define USBASP_SESSION_SIGNATURE  3  /* 3 bytes */
+#define USBASP_SESSION_LFUSE      6
+#define USBASP_SESSION_HFUSE      7
+#define USBASP_SESSION_EFUSE      8
+#define USBASP_SESSION_LOCK       9
+#define USBASP_SESSION_CALIBRATION 10
+#define USBASP_SESSION_LEN        11
+
+/* USB serial number, stored in programmer EEPROM */
+#define USBASP_SERIAL_MAX     8   /* max. characters */
 
 /* ISP SCK speed identifiers */
 #define USBASP_ISP_SCK_AUTO   0
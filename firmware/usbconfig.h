@@ -35,12 +35,10 @@ the newest features and options.
  * This may be any bit in the port. Please note that D+ must also be connected
  * to interrupt pin INT0!
  */
-<<<<<<< HEAD
-#define USB_CFG_CLOCK_KHZ 12000
-=======
-#define USB_CFG_CLOCK_KHZ       12000
->>>>>>> f51555f (Remove local v-usb and switch to the submodule)
-/* Clock rate of the AVR in MHz. Legal values are 12000, 16000 or 16500.
+#define USB_CFG_CLOCK_KHZ       (F_CPU/1000)
+/* Clock rate of the AVR in kHz. Legal values are 12000, 12800, 15000, 16000,
+ * 16500, 18000 and 20000. USBasp supports 12000, 16000 and 20000, set F_CPU
+ * in the Makefile.
  * The 16.5 MHz version of the code requires no crystal, it tolerates +/- 1%
  * deviation from the nominal frequency. All other rates require a precision
  * of 2000 ppm and thus a crystal!
@@ -63,9 +61,14 @@ the newest features and options.
 
 /* --------------------------- Functional Range ---------------------------- */
 
+#ifndef USB_CFG_HAVE_INTRIN_ENDPOINT
 #define USB_CFG_HAVE_INTRIN_ENDPOINT    0
+#endif
 /* Define this to 1 if you want to compile a version with two endpoints: The
  * default control endpoint 0 and an interrupt-in endpoint 1.
+ * USBasp: optional readback stream (USBASP_FUNC_STREAMREAD), enable with
+ * -DUSB_CFG_HAVE_INTRIN_ENDPOINT=1. Limited to 8 bytes per poll interval
+ * like the interrupt-out stream, see USB_CFG_IMPLEMENT_FN_WRITEOUT.
  */
 #define USB_CFG_HAVE_INTRIN_ENDPOINT3   0
 /* Define this to 1 if you want to compile a version with three endpoints: The
@@ -103,16 +106,28 @@ the newest features and options.
  * data from a static buffer, set it to 0 and return the data from
  * usbFunctionSetup(). This saves a couple of bytes.
  */
+#ifndef USB_CFG_IMPLEMENT_FN_WRITEOUT
 #define USB_CFG_IMPLEMENT_FN_WRITEOUT   0
+#endif
 /* Define this to 1 if you want to use interrupt-out (or bulk out) endpoint 1.
  * You must implement the function usbFunctionWriteOut() which receives all
  * interrupt/bulk data sent to endpoint 1.
+ * USBasp: optional flash data stream (USBASP_FUNC_STREAMWRITE), enable with
+ * -DUSB_CFG_IMPLEMENT_FN_WRITEOUT=1. Low speed interrupt endpoints carry one
+ * 8 byte packet per poll interval (>= 10 ms), that is at most 0.8 kB/s, so
+ * control transfers stay the faster default.
  */
-#define USB_CFG_HAVE_FLOWCONTROL        0
+#define USB_CFG_HAVE_FLOWCONTROL        1
 /* Define this to 1 if you want flowcontrol over USB data. See the definition
  * of the macros usbDisableAllRequests() and usbEnableAllRequests() in
  * usbdrv.h.
  */
+#define USB_CFG_LONG_TRANSFERS          1
+/* Define this to 1 if you want to send/receive blocks of more than 254 bytes
+ * in a single control-in or control-out transfer. Note that the capability
+ * for long transfers increases the driver size.
+ * USBasp: READFLASH/READEEPROM/TPI_READBLOCK honour the full 16 bit wLength.
+ */
 
 /* -------------------------- Device Description --------------------------- */
 
@@ -215,12 +230,17 @@ the newest features and options.
  */
 
 #define USB_CFG_DESCR_PROPS_DEVICE                  0
+#if USB_CFG_IMPLEMENT_FN_WRITEOUT
+/* descriptor with interrupt-out endpoint 1 is in main.c */
+#define USB_CFG_DESCR_PROPS_CONFIGURATION           USB_PROP_LENGTH(18 + 7 + 7 * USB_CFG_HAVE_INTRIN_ENDPOINT)
+#else
 #define USB_CFG_DESCR_PROPS_CONFIGURATION           0
+#endif
 #define USB_CFG_DESCR_PROPS_STRINGS                 0
 #define USB_CFG_DESCR_PROPS_STRING_0                0
 #define USB_CFG_DESCR_PROPS_STRING_VENDOR           0
 #define USB_CFG_DESCR_PROPS_STRING_PRODUCT          0
-#define USB_CFG_DESCR_PROPS_STRING_SERIAL_NUMBER    0
+#define USB_CFG_DESCR_PROPS_STRING_SERIAL_NUMBER    (USB_PROP_IS_DYNAMIC | USB_PROP_IS_RAM)
 #define USB_CFG_DESCR_PROPS_HID                     0
 #define USB_CFG_DESCR_PROPS_HID_REPORT              0
 #define USB_CFG_DESCR_PROPS_UNKNOWN                 0